@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Writes the synthetic recording replayed by `meson test`: rounds of typing
+# with rollover, VIM motions with Alt, Next (a volume command in
+# config.yml), the forward button while the left button is held, and 3
+# and 4 finger swipes.
+#
+# The output is the record format of src/replay.c (RECORD_VERSION 1), in
+# little-endian byte order. Keep them in sync.
+
+import random
+import struct
+import sys
+
+RECORD_MAGIC = b'RYDREC\0\0'
+RECORD_VERSION = 1
+# struct ryd_event
+EVENT_FORMAT = '<QBBBBIff'
+
+# enum ryd_event_type
+KEY, SWIPE_BEGIN, SWIPE_UPDATE, SWIPE_END = range(4)
+
+# linux/input-event-codes.h
+KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P = \
+    range(16, 26)
+KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L = range(30, 39)
+KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M = range(44, 51)
+KEY_LEFTALT = 56
+KEY_SPACE = 57
+KEY_PAGEDOWN = 109
+BTN_LEFT = 0x110
+BTN_EXTRA = 0x114
+
+LETTERS = [
+    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
+    KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
+    KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_SPACE,
+]
+# (fingers, dx, dy) of each swipe of a round
+SWIPES = [(3, 0, -6), (3, 5, 0), (4, -4, 0), (4, 0, 5)]
+NR_ROUNDS = 10
+
+
+class Recording:
+    def __init__(self):
+        self.events = []
+        self.time_usec = 1000000
+
+    def add(self, type, dt, pressed=0, fingers=0, keycode=0, dx=0., dy=0.):
+        self.time_usec += dt
+        self.events.append(struct.pack(EVENT_FORMAT, self.time_usec, type,
+                                       pressed, fingers, 0, keycode, dx, dy))
+
+    def press(self, keycode, dt):
+        self.add(KEY, dt, pressed=1, keycode=keycode)
+
+    def release(self, keycode, dt):
+        self.add(KEY, dt, pressed=0, keycode=keycode)
+
+    def tap(self, keycode, hold=40000, gap=60000):
+        self.press(keycode, gap)
+        self.release(keycode, hold)
+
+    def write(self, path):
+        with open(path, 'wb') as f:
+            f.write(RECORD_MAGIC)
+            f.write(struct.pack('<II', RECORD_VERSION,
+                                struct.calcsize(EVENT_FORMAT)))
+            f.write(b''.join(self.events))
+
+
+def main():
+    # Seeded so that every run replays the same events
+    rng = random.Random(1)
+    rec = Recording()
+    for _ in range(NR_ROUNDS):
+        # Pairs of letters, the second pressed before the first is
+        # released
+        for _ in range(40):
+            a = rng.choice(LETTERS)
+            b = rng.choice(LETTERS)
+            if a == b:
+                rec.tap(a)
+                continue
+            rec.press(a, 50000)
+            rec.press(b, 30000)
+            rec.release(a, 20000)
+            rec.release(b, 30000)
+
+        rec.press(KEY_LEFTALT, 100000)
+        for keycode in rng.choices([KEY_H, KEY_J, KEY_K, KEY_L], k=12):
+            rec.tap(keycode, hold=30000, gap=40000)
+        rec.release(KEY_LEFTALT, 50000)
+
+        rec.tap(KEY_PAGEDOWN)
+
+        rec.press(BTN_LEFT, 100000)
+        rec.tap(BTN_EXTRA)
+        rec.release(BTN_LEFT, 50000)
+
+        for fingers, dx, dy in SWIPES:
+            rec.add(SWIPE_BEGIN, 200000, fingers=fingers)
+            for _ in range(30):
+                rec.add(SWIPE_UPDATE, 7000, fingers=fingers,
+                        dx=dx + rng.uniform(-1, 1),
+                        dy=dy + rng.uniform(-1, 1))
+            rec.add(SWIPE_END, 7000, fingers=fingers)
+    rec.write(sys.argv[1])
+
+
+if __name__ == '__main__':
+    main()
@@ -1,66 +1,131 @@
 #include "rydeen.h"
 #include <ev.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <wait.h>
 
-typedef __typeof__((key_signals_t){0}.head) key_signal_it_t;
-
-struct key_action_context {
-	struct server *server;
-	key_signals_t *signals;
-	key_signal_it_t signal_it;
-	ev_timer timer;
-};
+extern char **environ;
 
 static inline void
-send_key_signal(struct key_action_context *ctx)
+send_key_signal(struct server *server, struct pending_key_action *action)
+{
+	const struct key_signal *signal = action->signal++;
+	uinput_send(server, signal->keycode, signal->press, true);
+}
+
+static inline struct pending_key_action *
+queue_item(struct key_action_queue *queue, uint32_t i)
 {
-	struct key_signal *signal = &ctx->signal_it->item;
-	uinput_send(ctx->server, signal->keycode, signal->press, true);
-	ctx->signal_it = ctx->signal_it->next;
+	return &queue->items[(queue->head + i) % queue->size];
+}
+
+// Sends the signals due at an interval, and drops finished key actions
+static void
+send_queued_signals(struct server *server)
+{
+	struct key_action_queue *queue = &server->key_actions;
+
+	if (server->config.key_action_policy != KEY_ACTION_INTERLEAVE) {
+		struct pending_key_action *action = queue_item(queue, 0);
+		send_key_signal(server, action);
+		if (action->signal == action->end) {
+			queue->head = (queue->head + 1) % queue->size;
+			queue->len--;
+		}
+		return;
+	}
+
+	// Keep the unfinished ones in order
+	uint32_t len = 0;
+	for (uint32_t i = 0; i < queue->len; i++) {
+		struct pending_key_action *action = queue_item(queue, i);
+		send_key_signal(server, action);
+		if (action->signal < action->end)
+			*queue_item(queue, len++) = *action;
+	}
+	queue->len = len;
 }
 
 static void
 handle_key_action_timeout(struct ev_loop *loop, ev_timer *timer, int revents)
 {
-	struct key_action_context *ctx = timer->data;
-	send_key_signal(ctx);
-	if (!ctx->signal_it) {
+	struct server *server = timer->data;
+	struct key_action_queue *queue = &server->key_actions;
+
+	send_queued_signals(server);
+	uinput_flush(server);
+	if (queue->len == 0)
 		ev_timer_stop(loop, timer);
-		free(ctx);
-	} else {
-		ev_timer_again(loop, timer);
-	}
 }
 
 static void
-run_key_action(struct server *server, key_signals_t *signals)
+run_key_action(struct server *server, const struct action *action)
 {
-	struct ev_loop *loop = server->loop;
 	struct config *config = &server->config;
+	struct key_action_queue *queue = &server->key_actions;
 
-	struct key_action_context *ctx = znew(*ctx);
-	ctx->server = server;
-	ctx->signals = signals;
-	ctx->signal_it = signals->head;
+	struct pending_key_action pending = {
+		.signal = action->signals,
+		.end = action->signals + action->nr_signals,
+	};
+	if (pending.signal == pending.end)
+		return;
 
 	if (config->key_interval == 0.) {
-		while (ctx->signal_it)
-			send_key_signal(ctx);
-		free(ctx);
-	} else {
-		send_key_signal(ctx);
-		if (ctx->signal_it) {
-			ctx->timer.data = ctx;
-			ev_timer_init(&ctx->timer, handle_key_action_timeout,
-				      0., config->key_interval);
-			ev_timer_again(loop, &ctx->timer);
-		} else {
-			free(ctx);
-		}
+		latency_mark(server, LATENCY_KEY_ACTION);
+		uinput_send_action(server, action);
+		return;
+	}
+
+	if (queue->len > 0 && config->key_action_policy == KEY_ACTION_DROP) {
+		debug("Dropped key action\n");
+		return;
+	}
+	if (queue->len == queue->size) {
+		debug("Key action queue is full\n");
+		return;
 	}
+
+	// The first signal is sent immediately unless other key actions go
+	// before it
+	if (queue->len == 0
+	    || config->key_action_policy == KEY_ACTION_INTERLEAVE) {
+		latency_mark(server, LATENCY_KEY_ACTION);
+		send_key_signal(server, &pending);
+		if (pending.signal == pending.end)
+			return;
+	}
+	*queue_item(queue, queue->len++) = pending;
+	if (!ev_is_active(&queue->timer)) {
+		queue->timer.repeat = config->key_interval;
+		ev_timer_again(server->loop, &queue->timer);
+	}
+}
+
+void
+action_init(struct server *server)
+{
+	struct key_action_queue *queue = &server->key_actions;
+
+	free(queue->items);
+	queue->size = server->config.key_action_queue_size;
+	queue->items = calloc(queue->size, sizeof(*queue->items));
+	queue->head = 0;
+	queue->len = 0;
+	queue->timer.data = server;
+	ev_init(&queue->timer, handle_key_action_timeout);
+}
+
+void
+action_finish(struct server *server)
+{
+	action_flush(server);
+	free(server->key_actions.items);
+	server->key_actions.items = NULL;
 }
 
 static void
@@ -75,35 +140,103 @@ handle_process_exit(struct ev_loop *loop, struct ev_child *child_watcher,
 	free(child_watcher);
 }
 
+pid_t
+spawn_command(const char *cmd, char *const *argv)
+{
+	posix_spawn_file_actions_t file_actions;
+	posix_spawn_file_actions_init(&file_actions);
+	posix_spawn_file_actions_addclose(&file_actions, STDIN_FILENO);
+	posix_spawn_file_actions_addclose(&file_actions, STDOUT_FILENO);
+
+	posix_spawnattr_t attr;
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+
+	debug("Executing command: %s\n", cmd);
+
+	// posix_spawn() shares the address space with the child until exec
+	// instead of copying the page tables of the daemon like fork()
+	pid_t pid;
+	int err;
+	if (argv) {
+		err = posix_spawnp(&pid, argv[0], &file_actions, &attr, argv,
+				   environ);
+	} else {
+		char *sh_argv[] = {"/bin/sh", "-c", (char *)cmd, NULL};
+		err = posix_spawn(&pid, sh_argv[0], &file_actions, &attr,
+				  sh_argv, environ);
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&file_actions);
+
+	if (err) {
+		fprintf(stderr, "Could not run command: %s (%s)\n", cmd,
+			strerror(err));
+		return -1;
+	}
+	return pid;
+}
+
 static void
-run_command_action(struct server *server, const char *cmd)
+run_command_action(struct server *server, const struct action *action)
 {
 	struct ev_loop *loop = server->loop;
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		debug("Executing command: %s\n", cmd);
-		close(STDIN_FILENO);
-		close(STDOUT_FILENO);
-		execlp("/bin/sh", "/bin/sh", "-c", cmd, NULL);
-		fprintf(stderr, "Could not run command: %s\n", cmd);
-		exit(1);
-	} else {
-		struct ev_child *child_watcher = znew(*child_watcher);
-		ev_child_init(child_watcher, handle_process_exit, pid, 0);
-		ev_child_start(loop, child_watcher);
+	if (server->dry_run) {
+		debug("Skipped command: %s\n", action->cmd);
+		server->nr_skipped_commands++;
+		latency_mark(server, LATENCY_COMMAND);
+		return;
+	}
+
+	if (spawn_helper_run(server, action)) {
+		latency_mark(server, LATENCY_COMMAND);
+		return;
 	}
+
+	pid_t pid = spawn_command(action->cmd, action->argv);
+	if (pid < 0)
+		return;
+	latency_mark(server, LATENCY_COMMAND);
+
+	// Child watchers only work in the default loop. Children spawned by
+	// the action thread are reaped by its SIGCHLD handler.
+	if (!ev_is_default_loop(loop))
+		return;
+
+	struct ev_child *child_watcher = znew(*child_watcher);
+	ev_child_init(child_watcher, handle_process_exit, pid, 0);
+	ev_child_start(loop, child_watcher);
 }
 
 void
-action_run(struct server *server, struct action *action)
+action_flush(struct server *server)
 {
+	struct key_action_queue *queue = &server->key_actions;
+
+	while (queue->len > 0)
+		send_queued_signals(server);
+	ev_timer_stop(server->loop, &queue->timer);
+}
+
+void
+action_run(struct server *server, const struct action *action)
+{
+	if (server->action_thread) {
+		action_thread_run(server, action);
+		return;
+	}
+
 	switch (action->type) {
 	case ACTION_KEY:
-		run_key_action(server, &action->signals);
+		run_key_action(server, action);
 		break;
 	case ACTION_COMMAND:
-		run_command_action(server, action->cmd);
+		run_command_action(server, action);
 		break;
 	default:
 		break;
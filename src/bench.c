@@ -0,0 +1,417 @@
+#include "rydeen.h"
+#include <ev.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each benchmark is run with doubling iterations until it takes
+// BENCH_MIN_NSEC. Results are printed as tab-separated lines of name,
+// iterations and ns per iteration.
+#define BENCH_MIN_NSEC 100000000ull
+#define BENCH_MAX_ITERATIONS (1ull << 32)
+
+// Modifiers in synthetic configs, triggered by F1 to F8
+#define BENCH_NR_MODIFIERS 8
+
+// Keeps the compiler from optimizing the benchmarked code away
+static volatile uint64_t sink;
+// Prefix of the names of the benchmarks to run, or NULL for all
+static const char *filter;
+
+static uint64_t
+get_time_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool
+is_selected(const char *name)
+{
+	return !filter || !strncmp(name, filter, strlen(filter));
+}
+
+// Returns true if some benchmarks named group... may be selected, to skip
+// setting them up otherwise
+static bool
+is_group_selected(const char *group)
+{
+	if (!filter)
+		return true;
+	size_t len = strlen(filter);
+	if (strlen(group) < len)
+		len = strlen(group);
+	return !strncmp(group, filter, len);
+}
+
+static void
+run(const char *name, void (*fn)(void *data, uint64_t nr_iterations),
+    void *data)
+{
+	if (!is_selected(name))
+		return;
+
+	uint64_t nr_iterations = 1;
+	uint64_t elapsed;
+	for (;;) {
+		uint64_t start = get_time_nsec();
+		fn(data, nr_iterations);
+		elapsed = get_time_nsec() - start;
+		if (elapsed >= BENCH_MIN_NSEC
+		    || nr_iterations >= BENCH_MAX_ITERATIONS)
+			break;
+		nr_iterations *= 2;
+	}
+	printf("%s\t%" PRIu64 "\t%.2f\n", name, nr_iterations,
+	       (double)elapsed / nr_iterations);
+	fflush(stdout);
+}
+
+static void
+bench_keyset_add_remove(void *data, uint64_t nr_iterations)
+{
+	struct ryd_keyset set = {0};
+	uint64_t changed = 0;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		uint32_t keycode = i % MAX_KEYCODE;
+		changed += ryd_keyset_add(&set, keycode);
+		changed += ryd_keyset_remove(&set, keycode);
+	}
+	sink = changed;
+}
+
+static void
+bench_keyset_contains(void *data, uint64_t nr_iterations)
+{
+	struct ryd_keyset set = {0};
+	for (uint32_t keycode = 0; keycode < MAX_KEYCODE; keycode += 3)
+		ryd_keyset_add(&set, keycode);
+	uint64_t found = 0;
+	for (uint64_t i = 0; i < nr_iterations; i++)
+		found += ryd_keyset_contains(&set, i % MAX_KEYCODE);
+	sink = found;
+}
+
+static void
+bench_direction_opposite(void *data, uint64_t nr_iterations)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < nr_iterations; i++)
+		sum += direction_opposite(i % 5);
+	sink = sum;
+}
+
+static void
+bench_keyname_to_keycode(void *data, uint64_t nr_iterations)
+{
+	static const char *keynames[] = {
+		"a",	       "Control_L",	       "Super_L", "mouse:left",
+		"Caps_Lock",  "XF86AudioRaiseVolume", "Next",    "NoSuchKey",
+	};
+	struct parser_context *ctx = data;
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		sum += keyname_to_keycode(ctx,
+					  keynames[i % ARRAY_SIZE(keynames)]);
+	}
+	sink = sum;
+}
+
+static void
+bench_undo_key_signals(void *data, uint64_t nr_iterations)
+{
+	key_signals_t *signals = data;
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		key_signals_t undo = get_undo_key_signals(signals);
+		sum += tll_length(undo);
+		tll_free(undo);
+	}
+	sink = sum;
+}
+
+static void
+push_signal(key_signals_t *signals, bool press, uint32_t keycode)
+{
+	struct key_signal signal = {.press = press, .keycode = keycode};
+	tll_push_back(*signals, signal);
+}
+
+// Runs the config primitives on the keymap of the default RMLVO
+static void
+bench_config_primitives(void)
+{
+	if (!is_group_selected("keyname_to_keycode")
+	    && !is_group_selected("undo_key_signals"))
+		return;
+
+	struct parser_context *ctx = config_keymap_new();
+	if (ctx) {
+		run("keyname_to_keycode", bench_keyname_to_keycode, ctx);
+		config_keymap_free(ctx);
+	}
+
+	// Like [+Control_L, +Shift_L, Left, Left, ..., -Shift_L], which
+	// leaves Control_L pressed
+	key_signals_t signals = {0};
+	push_signal(&signals, true, KEY_LEFTCTRL);
+	push_signal(&signals, true, KEY_LEFTSHIFT);
+	for (int i = 0; i < 8; i++) {
+		push_signal(&signals, true, KEY_LEFT);
+		push_signal(&signals, false, KEY_LEFT);
+	}
+	push_signal(&signals, false, KEY_LEFTSHIFT);
+	run("undo_key_signals", bench_undo_key_signals, &signals);
+	tll_free(signals);
+}
+
+// Config with nr_keybinds keybinds on letters with combinations of the
+// modifiers, and one gesturebind for 3 fingers swipe up
+static char *
+synthetic_config(int nr_keybinds, size_t *len)
+{
+	char *yaml = NULL;
+	FILE *stream = open_memstream(&yaml, len);
+	fprintf(stream, "general:\n"
+			"  keyboard:\n"
+			"    layout: us\n"
+			"modifiers:\n");
+	for (int i = 0; i < BENCH_NR_MODIFIERS; i++)
+		fprintf(stream, "  M%d:\n    - { key: F%d }\n", i, i + 1);
+
+	fprintf(stream, "keybinds:\n");
+	for (int i = 0; i < nr_keybinds; i++) {
+		int modifiers = (i / 26) % (1 << BENCH_NR_MODIFIERS);
+		fprintf(stream, "  - key: %c\n", 'a' + i % 26);
+		if (modifiers) {
+			fprintf(stream, "    modifiers: [");
+			const char *sep = "";
+			for (int j = 0; j < BENCH_NR_MODIFIERS; j++) {
+				if (!(modifiers & (1 << j)))
+					continue;
+				fprintf(stream, "%sM%d", sep, j);
+				sep = ", ";
+			}
+			fprintf(stream, "]\n");
+		}
+		fprintf(stream, "    on_press: [+Control_L, Left]\n");
+	}
+
+	fprintf(stream, "gesturebinds:\n"
+			"  - gesture: swipe\n"
+			"    fingers: 3\n"
+			"    direction: up\n"
+			"    on_forward: [+Super_L, Tab]\n");
+	fclose(stream);
+	return yaml;
+}
+
+struct parse_bench {
+	char *yaml;
+	size_t len;
+};
+
+static void
+bench_config_parse(void *data, uint64_t nr_iterations)
+{
+	struct parse_bench *bench = data;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		struct config config = {0};
+		if (config_parse(&config, bench->yaml, bench->len))
+			sink = config.nr_keybinds;
+		config_free(&config);
+	}
+}
+
+static void
+bench_config_load(void *data, uint64_t nr_iterations)
+{
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		struct config config = {0};
+		if (config_load(&config, true))
+			sink = config.nr_keybinds;
+		config_free(&config);
+	}
+}
+
+static void
+send_key(struct server *server, uint32_t keycode, bool pressed)
+{
+	struct ryd_event event = {
+		.type = RYD_EVENT_KEY,
+		.keycode = keycode,
+		.pressed = pressed,
+	};
+	handle_input_event(server, &server->unknown_device, &event);
+}
+
+static void
+bench_keybind(void *data, uint64_t nr_iterations)
+{
+	struct server *server = data;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		send_key(server, KEY_A, true);
+		send_key(server, KEY_A, false);
+		uinput_flush(server);
+	}
+}
+
+static void
+bench_modifier_keybind(void *data, uint64_t nr_iterations)
+{
+	struct server *server = data;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		// M0 and M1 are on the fourth round of letters, so this is
+		// bound with 104 keybinds or more
+		send_key(server, KEY_F1, true);
+		send_key(server, KEY_F2, true);
+		send_key(server, KEY_D, true);
+		send_key(server, KEY_D, false);
+		send_key(server, KEY_F2, false);
+		send_key(server, KEY_F1, false);
+		uinput_flush(server);
+	}
+}
+
+static void
+bench_passthrough(void *data, uint64_t nr_iterations)
+{
+	struct server *server = data;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		send_key(server, KEY_F12, true);
+		send_key(server, KEY_F12, false);
+		uinput_flush(server);
+	}
+}
+
+static void
+bench_swipe(void *data, uint64_t nr_iterations)
+{
+	struct server *server = data;
+	struct input_device *device = &server->unknown_device;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		struct ryd_event event = {
+			.type = RYD_EVENT_SWIPE_BEGIN,
+			.nr_fingers = 3,
+		};
+		handle_input_event(server, device, &event);
+		event.type = RYD_EVENT_SWIPE_UPDATE;
+		event.dy = -10.f;
+		for (int j = 0; j < 8; j++)
+			handle_input_event(server, device, &event);
+		event.type = RYD_EVENT_SWIPE_END;
+		event.dy = 0.f;
+		handle_input_event(server, device, &event);
+		uinput_flush(server);
+	}
+}
+
+static void
+bench_output(void *data, uint64_t nr_iterations)
+{
+	struct server *server = data;
+	for (uint64_t i = 0; i < nr_iterations; i++) {
+		// Hardly any desktop binds F24
+		uinput_send(server, KEY_F24, true, false);
+		uinput_send(server, KEY_F24, false, false);
+		uinput_flush(server);
+	}
+}
+
+// Compares the backends writing to the uinput devices
+static void
+bench_outputs(void)
+{
+	static const char *outputs[] = {
+		"uinput",
+#if HAVE_IO_URING
+		"uring",
+#endif
+	};
+
+	if (access("/dev/uinput", W_OK) < 0)
+		return;
+	for (int i = 0; i < ARRAY_SIZE(outputs); i++) {
+		struct server server = {.loop = ev_default_loop(0)};
+		if (!uinput_init(&server, outputs[i]))
+			continue;
+		char name[64];
+		snprintf(name, sizeof(name), "output/%s", outputs[i]);
+		run(name, bench_output, &server);
+		uinput_finish(&server);
+	}
+}
+
+static bool
+bench_dispatch(int nr_keybinds, const struct parse_bench *config)
+{
+	struct server server = {
+		.loop = ev_default_loop(0),
+		.dry_run = true,
+	};
+	if (!config_parse(&server.config, config->yaml, config->len))
+		return false;
+	action_init(&server);
+	bool ok = uinput_init(&server, "ring");
+	if (ok) {
+		char name[64];
+		snprintf(name, sizeof(name), "keybind/%d", nr_keybinds);
+		run(name, bench_keybind, &server);
+		snprintf(name, sizeof(name), "modifier_keybind/%d",
+			 nr_keybinds);
+		run(name, bench_modifier_keybind, &server);
+		snprintf(name, sizeof(name), "passthrough/%d", nr_keybinds);
+		run(name, bench_passthrough, &server);
+		snprintf(name, sizeof(name), "swipe/%d", nr_keybinds);
+		run(name, bench_swipe, &server);
+	}
+	action_finish(&server);
+	uinput_finish(&server);
+	config_finish(&server);
+	return ok;
+}
+
+bool
+bench_run(const char *prefix)
+{
+	static const int sizes[] = {10, 1000, 10000};
+
+	filter = prefix;
+	printf("# benchmark\titerations\tns/op\n");
+	run("keyset_add_remove", bench_keyset_add_remove, NULL);
+	run("keyset_contains", bench_keyset_contains, NULL);
+	run("direction_opposite", bench_direction_opposite, NULL);
+	bench_config_primitives();
+
+	bool dispatch = is_group_selected("keybind")
+			|| is_group_selected("modifier_keybind")
+			|| is_group_selected("passthrough")
+			|| is_group_selected("swipe");
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (!dispatch && !is_group_selected("config_parse"))
+			break;
+		struct parse_bench config;
+		config.yaml = synthetic_config(sizes[i], &config.len);
+		char name[64];
+		snprintf(name, sizeof(name), "config_parse/%d", sizes[i]);
+		run(name, bench_config_parse, &config);
+		bool ok = !dispatch || bench_dispatch(sizes[i], &config);
+		free(config.yaml);
+		if (!ok)
+			return false;
+	}
+
+	// The config file is loaded as on startup, from the cache if it's
+	// up to date
+	if (config_find_path())
+		run("config_load", bench_config_load, NULL);
+
+	// They send keys to the desktop, so only --bench=output/... runs them
+	if (filter && !strncmp(filter, "output/", strlen("output/")))
+		bench_outputs();
+	return true;
+}
@@ -0,0 +1,721 @@
+#include "rydeen.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The cache is a binary image of a parsed config. Keycodes are already
+// resolved and modifiers are referenced by index, so loading it doesn't
+// need libyaml. The keymap is still compiled to check that the keycodes
+// match the installed XKB data. It consists of the header followed by
+// the sections below, each aligned to 8 bytes.
+#define CACHE_MAGIC "RYDCACHE"
+#define CACHE_VERSION 11
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	// Hash of the config file and the RMLVO defaults
+	uint64_t hash;
+	uint64_t keymap_hash;
+	// Offsets of the RMLVO names in strings + 1, or 0 for the defaults
+	uint32_t rmlvo[5];
+
+	double swipe_thr;
+	double swipe_velocity;
+	double swipe_min_distance;
+	double swipe_angle;
+	double key_interval;
+	double key_repeat_delay;
+	double key_repeat_interval;
+	double tap_timeout;
+	uint32_t key_action_policy;
+	uint32_t key_action_queue_size;
+	uint32_t spawn_helper;
+	uint32_t action_thread;
+	uint32_t direct_keyboards;
+	uint32_t realtime_priority;
+	uint32_t lock_memory;
+	uint64_t cpu_affinity;
+
+	uint32_t nr_modifiers;
+	uint32_t nr_modifier_keys;
+	uint32_t nr_keybinds;
+	uint32_t nr_gesturebinds;
+	uint32_t nr_sequences;
+	uint32_t nr_sequence_keys;
+	uint32_t nr_signals;
+	uint32_t nr_args;
+	uint32_t strings_size;
+};
+
+struct cache_modifier {
+	uint32_t name; // offset in strings
+	uint32_t first_key;
+	uint32_t nr_keys;
+};
+
+struct cache_modifier_key {
+	uint32_t keycode;
+	uint32_t send_keycode;
+	uint32_t tap_keycode;
+};
+
+struct cache_action {
+	uint32_t type;
+	// Index of the first signal if type == ACTION_KEY, or offset of the
+	// command in strings if type == ACTION_COMMAND
+	uint32_t start;
+	uint32_t nr_signals;
+	// Words of argv in args if type == ACTION_COMMAND. nr_args is 0 if
+	// the command needs to be run by shell.
+	uint32_t first_arg;
+	uint32_t nr_args;
+};
+
+struct cache_keybind {
+	uint64_t modifiers;
+	uint32_t keycode;
+	// Offset of the device in strings + 1, or 0 for any device
+	uint32_t device;
+	struct cache_action on_press;
+	struct cache_action on_release;
+};
+
+struct cache_gesturebind {
+	int32_t nr_fingers;
+	uint32_t direction;
+	uint32_t repeat;
+	struct cache_action on_forward;
+	struct cache_action on_backward;
+};
+
+struct cache_sequence {
+	double timeout;
+	uint32_t first_key;
+	uint32_t nr_keys;
+	struct cache_action on_match;
+};
+
+struct cache_signal {
+	uint32_t keycode;
+	uint32_t press;
+};
+
+struct cache_image {
+	char *data;
+	struct cache_header *header;
+	struct cache_modifier *modifiers;
+	struct cache_modifier_key *modifier_keys;
+	struct cache_keybind *keybinds;
+	struct cache_gesturebind *gesturebinds;
+	struct cache_sequence *sequences;
+	uint32_t *sequence_keys;
+	struct cache_signal *signals;
+	// Offsets of the words of argv in strings
+	uint32_t *args;
+	char *strings;
+};
+
+// Offsets of the sections in the image
+struct cache_layout {
+	size_t modifiers;
+	size_t modifier_keys;
+	size_t keybinds;
+	size_t gesturebinds;
+	size_t sequences;
+	size_t sequence_keys;
+	size_t signals;
+	size_t args;
+	size_t strings;
+	size_t size;
+};
+
+static inline size_t
+align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static struct cache_layout
+get_layout(const struct cache_header *header)
+{
+	struct cache_layout layout;
+	size_t offset = align8(sizeof(*header));
+
+	layout.modifiers = offset;
+	offset = align8(offset
+			+ header->nr_modifiers * sizeof(struct cache_modifier));
+	layout.modifier_keys = offset;
+	offset = align8(offset
+			+ header->nr_modifier_keys
+				  * sizeof(struct cache_modifier_key));
+	layout.keybinds = offset;
+	offset = align8(offset
+			+ header->nr_keybinds * sizeof(struct cache_keybind));
+	layout.gesturebinds = offset;
+	offset = align8(offset
+			+ header->nr_gesturebinds
+				  * sizeof(struct cache_gesturebind));
+	layout.sequences = offset;
+	offset = align8(offset
+			+ header->nr_sequences * sizeof(struct cache_sequence));
+	layout.sequence_keys = offset;
+	offset = align8(offset + header->nr_sequence_keys * sizeof(uint32_t));
+	layout.signals = offset;
+	offset = align8(offset
+			+ header->nr_signals * sizeof(struct cache_signal));
+	layout.args = offset;
+	offset = align8(offset + header->nr_args * sizeof(uint32_t));
+	layout.strings = offset;
+	layout.size = offset + header->strings_size;
+	return layout;
+}
+
+static struct cache_image
+map_image(char *data, const struct cache_layout *layout)
+{
+	struct cache_image image = {.data = data};
+	image.header = (void *)data;
+	image.modifiers = (void *)(data + layout->modifiers);
+	image.modifier_keys = (void *)(data + layout->modifier_keys);
+	image.keybinds = (void *)(data + layout->keybinds);
+	image.gesturebinds = (void *)(data + layout->gesturebinds);
+	image.sequences = (void *)(data + layout->sequences);
+	image.sequence_keys = (void *)(data + layout->sequence_keys);
+	image.signals = (void *)(data + layout->signals);
+	image.args = (void *)(data + layout->args);
+	image.strings = data + layout->strings;
+	return image;
+}
+
+static void
+count_action(const struct action *action, struct cache_header *header)
+{
+	switch (action->type) {
+	case ACTION_NONE:
+		break;
+	case ACTION_KEY:
+		header->nr_signals += action->nr_signals;
+		break;
+	case ACTION_COMMAND:
+		header->strings_size += strlen(action->cmd) + 1;
+		if (!action->argv)
+			break;
+		for (char **arg = action->argv; *arg; arg++) {
+			header->strings_size += strlen(*arg) + 1;
+			header->nr_args++;
+		}
+		break;
+	}
+}
+
+static uint32_t
+put_string(struct cache_image *image, uint32_t *strings_size,
+	   const char *str)
+{
+	uint32_t offset = *strings_size;
+	size_t len = strlen(str) + 1;
+	memcpy(&image->strings[offset], str, len);
+	*strings_size += len;
+	return offset;
+}
+
+// Counts of the items already put in the image
+struct cache_cursor {
+	uint32_t nr_modifier_keys;
+	uint32_t nr_signals;
+	uint32_t nr_args;
+	uint32_t strings_size;
+};
+
+static struct cache_action
+put_action(struct cache_image *image, struct cache_cursor *cursor,
+	   const struct action *action)
+{
+	struct cache_action result = {.type = action->type};
+
+	switch (action->type) {
+	case ACTION_NONE:
+		break;
+	case ACTION_KEY:
+		result.start = cursor->nr_signals;
+		result.nr_signals = action->nr_signals;
+		for (uint32_t i = 0; i < action->nr_signals; i++) {
+			image->signals[cursor->nr_signals++] =
+				(struct cache_signal){
+					.keycode = action->signals[i].keycode,
+					.press = action->signals[i].press,
+				};
+		}
+		break;
+	case ACTION_COMMAND:
+		result.start =
+			put_string(image, &cursor->strings_size, action->cmd);
+		if (!action->argv)
+			break;
+		result.first_arg = cursor->nr_args;
+		for (char **arg = action->argv; *arg; arg++) {
+			image->args[cursor->nr_args++] = put_string(
+				image, &cursor->strings_size, *arg);
+			result.nr_args++;
+		}
+		break;
+	}
+	return result;
+}
+
+static bool
+write_image(const struct cache_image *image, size_t size)
+{
+	const char *tmp_path = RYDEEN_CACHE_PATH ".tmp";
+
+	if (mkdir(RYDEEN_CACHE_DIR, 0755) < 0 && errno != EEXIST)
+		return false;
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      0644);
+	if (fd < 0)
+		return false;
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t len = write(fd, image->data + written, size - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += len;
+	}
+	close(fd);
+
+	// Replace the old cache atomically
+	if (written < size || rename(tmp_path, RYDEEN_CACHE_PATH) < 0) {
+		unlink(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+bool
+config_cache_save(const struct config *config, uint64_t hash)
+{
+	struct cache_header header = {
+		.version = CACHE_VERSION,
+		.hash = hash,
+		.keymap_hash = config->keymap_hash,
+		.swipe_thr = config->swipe_thr,
+		.swipe_velocity = config->swipe_velocity,
+		.swipe_min_distance = config->swipe_min_distance,
+		.swipe_angle = config->swipe_angle,
+		.key_interval = config->key_interval,
+		.key_repeat_delay = config->key_repeat_delay,
+		.key_repeat_interval = config->key_repeat_interval,
+		.tap_timeout = config->tap_timeout,
+		.key_action_policy = config->key_action_policy,
+		.key_action_queue_size = config->key_action_queue_size,
+		.spawn_helper = config->spawn_helper,
+		.action_thread = config->action_thread,
+		.direct_keyboards = config->direct_keyboards,
+		.realtime_priority = config->realtime_priority,
+		.lock_memory = config->lock_memory,
+		.cpu_affinity = config->cpu_affinity,
+		.nr_modifiers = config->nr_modifiers,
+		.nr_keybinds = config->nr_keybinds,
+		.nr_gesturebinds = config->nr_gesturebinds,
+		.nr_sequences = config->nr_sequences,
+	};
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+	for (int i = 0; i < ARRAY_SIZE(config->rmlvo); i++) {
+		if (config->rmlvo[i])
+			header.strings_size += strlen(config->rmlvo[i]) + 1;
+	}
+	for (uint32_t i = 0; i < config->nr_modifiers; i++) {
+		header.nr_modifier_keys += config->modifiers[i].nr_keys;
+		header.strings_size += strlen(config->modifiers[i].name) + 1;
+	}
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		if (config->keybinds[i].device) {
+			header.strings_size +=
+				strlen(config->keybinds[i].device) + 1;
+		}
+		count_action(&config->keybinds[i].on_press, &header);
+		count_action(&config->keybinds[i].on_release, &header);
+	}
+	for (uint32_t i = 0; i < config->nr_gesturebinds; i++) {
+		count_action(&config->gesturebinds[i].on_forward, &header);
+		count_action(&config->gesturebinds[i].on_backward, &header);
+	}
+	for (uint32_t i = 0; i < config->nr_sequences; i++) {
+		header.nr_sequence_keys += config->sequences[i].nr_keys;
+		count_action(&config->sequences[i].on_match, &header);
+	}
+
+	struct cache_layout layout = get_layout(&header);
+	header.size = layout.size;
+	struct cache_image image = map_image(calloc(1, layout.size), &layout);
+	*image.header = header;
+
+	struct cache_cursor cursor = {0};
+	for (int i = 0; i < ARRAY_SIZE(config->rmlvo); i++) {
+		if (config->rmlvo[i]) {
+			image.header->rmlvo[i] =
+				put_string(&image, &cursor.strings_size,
+					   config->rmlvo[i])
+				+ 1;
+		}
+	}
+	for (uint32_t i = 0; i < config->nr_modifiers; i++) {
+		const struct modifier *modifier = &config->modifiers[i];
+		image.modifiers[i] = (struct cache_modifier){
+			.name = put_string(&image, &cursor.strings_size,
+					   modifier->name),
+			.first_key = cursor.nr_modifier_keys,
+			.nr_keys = modifier->nr_keys,
+		};
+		for (uint32_t j = 0; j < modifier->nr_keys; j++) {
+			image.modifier_keys[cursor.nr_modifier_keys++] =
+				(struct cache_modifier_key){
+					.keycode = modifier->keys[j].keycode,
+					.send_keycode =
+						modifier->keys[j].send_keycode,
+					.tap_keycode =
+						modifier->keys[j].tap_keycode,
+				};
+		}
+	}
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		const struct keybind *src = &config->keybinds[i];
+		struct cache_keybind *bind = &image.keybinds[i];
+		bind->modifiers = src->modifiers;
+		bind->keycode = src->keycode;
+		if (src->device) {
+			bind->device = put_string(&image, &cursor.strings_size,
+						  src->device)
+				       + 1;
+		}
+		bind->on_press = put_action(&image, &cursor, &src->on_press);
+		bind->on_release =
+			put_action(&image, &cursor, &src->on_release);
+	}
+	for (uint32_t i = 0; i < config->nr_gesturebinds; i++) {
+		const struct gesturebind *src = &config->gesturebinds[i];
+		struct cache_gesturebind *bind = &image.gesturebinds[i];
+		bind->nr_fingers = src->nr_fingers;
+		bind->direction = src->direction;
+		bind->repeat = src->repeat;
+		bind->on_forward =
+			put_action(&image, &cursor, &src->on_forward);
+		bind->on_backward =
+			put_action(&image, &cursor, &src->on_backward);
+	}
+	uint32_t nr_sequence_keys = 0;
+	for (uint32_t i = 0; i < config->nr_sequences; i++) {
+		const struct sequence *src = &config->sequences[i];
+		image.sequences[i] = (struct cache_sequence){
+			.timeout = src->timeout,
+			.first_key = nr_sequence_keys,
+			.nr_keys = src->nr_keys,
+			.on_match = put_action(&image, &cursor, &src->on_match),
+		};
+		memcpy(&image.sequence_keys[nr_sequence_keys], src->keycodes,
+		       src->nr_keys * sizeof(uint32_t));
+		nr_sequence_keys += src->nr_keys;
+	}
+
+	bool saved = write_image(&image, layout.size);
+	if (!saved)
+		debug("Could not save config cache to %s\n", RYDEEN_CACHE_PATH);
+	free(image.data);
+	return saved;
+}
+
+static bool
+validate_action(const struct cache_image *image,
+		const struct cache_action *action, struct config_size *size)
+{
+	const struct cache_header *header = image->header;
+
+	switch (action->type) {
+	case ACTION_NONE:
+		return true;
+	case ACTION_KEY:
+		size->nr_signals += action->nr_signals;
+		return (uint64_t)action->start + action->nr_signals
+			       <= header->nr_signals
+		       && size->nr_signals <= header->nr_signals;
+	case ACTION_COMMAND:
+		if (action->start >= header->strings_size)
+			return false;
+		if (!action->nr_args)
+			return true;
+		// including the terminating NULL
+		size->nr_args += action->nr_args + 1;
+		return (uint64_t)action->first_arg + action->nr_args
+			       <= header->nr_args
+		       && size->nr_args <= 2 * header->nr_args;
+	default:
+		return false;
+	}
+}
+
+// Checks every reference in the image so that loading it can't fail, and
+// counts the items of the config
+static bool
+validate_image(const struct cache_image *image, struct config_size *size)
+{
+	const struct cache_header *header = image->header;
+	if (header->strings_size
+	    && image->strings[header->strings_size - 1] != '\0')
+		return false;
+	if (header->nr_modifiers > MAX_MODIFIERS
+	    || header->key_action_policy > KEY_ACTION_DROP
+	    || header->key_action_queue_size == 0
+	    || header->realtime_priority > 99)
+		return false;
+
+	*size = (struct config_size){
+		.nr_modifiers = header->nr_modifiers,
+		.nr_keybinds = header->nr_keybinds,
+		.nr_gesturebinds = header->nr_gesturebinds,
+		.nr_sequences = header->nr_sequences,
+		.nr_sequence_keys = header->nr_sequence_keys,
+		.strings_size = header->strings_size,
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(header->rmlvo); i++) {
+		if (header->rmlvo[i] > header->strings_size)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < header->nr_modifiers; i++) {
+		const struct cache_modifier *modifier = &image->modifiers[i];
+		size->nr_modifier_keys += modifier->nr_keys;
+		if (modifier->name >= header->strings_size
+		    || (uint64_t)modifier->first_key + modifier->nr_keys
+			       > header->nr_modifier_keys
+		    || size->nr_modifier_keys > header->nr_modifier_keys)
+			return false;
+	}
+	for (uint32_t i = 0; i < header->nr_modifier_keys; i++) {
+		if (image->modifier_keys[i].keycode >= MAX_KEYCODE)
+			return false;
+	}
+	modmask_t valid_modifiers =
+		header->nr_modifiers == MAX_MODIFIERS
+			? ~(modmask_t)0
+			: ((modmask_t)1 << header->nr_modifiers) - 1;
+	for (uint32_t i = 0; i < header->nr_keybinds; i++) {
+		const struct cache_keybind *bind = &image->keybinds[i];
+		size->nr_modifier_keybinds +=
+			__builtin_popcountll(bind->modifiers);
+		if (bind->keycode >= MAX_KEYCODE
+		    || bind->device > header->strings_size
+		    || (bind->modifiers & ~valid_modifiers)
+		    || !validate_action(image, &bind->on_press, size)
+		    || !validate_action(image, &bind->on_release, size))
+			return false;
+	}
+	for (uint32_t i = 0; i < header->nr_gesturebinds; i++) {
+		const struct cache_gesturebind *bind = &image->gesturebinds[i];
+		if (bind->direction > DIRECTION_LEFT
+		    || !validate_action(image, &bind->on_forward, size)
+		    || !validate_action(image, &bind->on_backward, size))
+			return false;
+	}
+	uint32_t nr_sequence_keys = 0;
+	for (uint32_t i = 0; i < header->nr_sequences; i++) {
+		const struct cache_sequence *sequence = &image->sequences[i];
+		nr_sequence_keys += sequence->nr_keys;
+		if (!sequence->nr_keys || sequence->nr_keys > MAX_SEQUENCE_KEYS
+		    || !(sequence->timeout > 0.)
+		    || (uint64_t)sequence->first_key + sequence->nr_keys
+			       > header->nr_sequence_keys
+		    || nr_sequence_keys > header->nr_sequence_keys
+		    || !validate_action(image, &sequence->on_match, size))
+			return false;
+	}
+	for (uint32_t i = 0; i < header->nr_sequence_keys; i++) {
+		if (!image->sequence_keys[i]
+		    || image->sequence_keys[i] >= MAX_KEYCODE)
+			return false;
+	}
+	for (uint32_t i = 0; i < header->nr_signals; i++) {
+		if (image->signals[i].keycode >= MAX_KEYCODE)
+			return false;
+	}
+	for (uint32_t i = 0; i < header->nr_args; i++) {
+		if (image->args[i] >= header->strings_size)
+			return false;
+	}
+	return true;
+}
+
+static struct action
+get_action(const struct cache_image *image, struct config_arena *arena,
+	   char *strings, const struct cache_action *src)
+{
+	struct action action = {.type = src->type};
+
+	switch (src->type) {
+	case ACTION_KEY:
+		action.signals = arena->signals;
+		action.nr_signals = src->nr_signals;
+		for (uint32_t i = 0; i < src->nr_signals; i++) {
+			const struct cache_signal *signal =
+				&image->signals[src->start + i];
+			*arena->signals++ = (struct key_signal){
+				.keycode = signal->keycode,
+				.press = signal->press,
+			};
+		}
+		break;
+	case ACTION_COMMAND:
+		action.cmd = &strings[src->start];
+		if (!src->nr_args)
+			break;
+		action.argv = arena->args;
+		for (uint32_t i = 0; i < src->nr_args; i++) {
+			uint32_t arg = image->args[src->first_arg + i];
+			*arena->args++ = &strings[arg];
+		}
+		*arena->args++ = NULL;
+		break;
+	}
+	return action;
+}
+
+static void
+read_image(struct config *config, const struct cache_image *image,
+	   const struct config_size *size)
+{
+	const struct cache_header *header = image->header;
+
+	config->swipe_thr = header->swipe_thr;
+	config->swipe_velocity = header->swipe_velocity;
+	config->swipe_min_distance = header->swipe_min_distance;
+	config->swipe_angle = header->swipe_angle;
+	config->key_interval = header->key_interval;
+	config->key_repeat_delay = header->key_repeat_delay;
+	config->key_repeat_interval = header->key_repeat_interval;
+	config->tap_timeout = header->tap_timeout;
+	config->key_action_policy = header->key_action_policy;
+	config->key_action_queue_size = header->key_action_queue_size;
+	config->spawn_helper = header->spawn_helper;
+	config->action_thread = header->action_thread;
+	config->direct_keyboards = header->direct_keyboards;
+	config->realtime_priority = header->realtime_priority;
+	config->lock_memory = header->lock_memory;
+	config->cpu_affinity = header->cpu_affinity;
+
+	// The strings are copied at once, and referred to by their offsets
+	struct config_arena arena = config_alloc(config, size);
+	char *strings = arena.strings;
+	memcpy(strings, image->strings, header->strings_size);
+
+	for (int i = 0; i < ARRAY_SIZE(header->rmlvo); i++) {
+		if (header->rmlvo[i])
+			config->rmlvo[i] = &strings[header->rmlvo[i] - 1];
+	}
+	config->keymap_hash = header->keymap_hash;
+
+	for (uint32_t i = 0; i < header->nr_modifiers; i++) {
+		const struct cache_modifier *src = &image->modifiers[i];
+		struct modifier *modifier = &config->modifiers[i];
+		modifier->name = &strings[src->name];
+		modifier->keys = arena.modifier_keys;
+		modifier->nr_keys = src->nr_keys;
+		for (uint32_t j = 0; j < src->nr_keys; j++) {
+			const struct cache_modifier_key *key =
+				&image->modifier_keys[src->first_key + j];
+			*arena.modifier_keys++ = (struct modifier_key){
+				.keycode = key->keycode,
+				.send_keycode = key->send_keycode,
+				.tap_keycode = key->tap_keycode,
+			};
+		}
+	}
+	for (uint32_t i = 0; i < header->nr_keybinds; i++) {
+		const struct cache_keybind *src = &image->keybinds[i];
+		config->keybinds[i] = (struct keybind){
+			.keycode = src->keycode,
+			.modifiers = src->modifiers,
+			.device = src->device ? &strings[src->device - 1]
+					      : NULL,
+			.on_press = get_action(image, &arena, strings,
+					       &src->on_press),
+			.on_release = get_action(image, &arena, strings,
+						 &src->on_release),
+		};
+	}
+	for (uint32_t i = 0; i < header->nr_gesturebinds; i++) {
+		const struct cache_gesturebind *src = &image->gesturebinds[i];
+		config->gesturebinds[i] = (struct gesturebind){
+			.nr_fingers = src->nr_fingers,
+			.direction = src->direction,
+			.repeat = src->repeat,
+			.on_forward = get_action(image, &arena, strings,
+						 &src->on_forward),
+			.on_backward = get_action(image, &arena, strings,
+						  &src->on_backward),
+		};
+	}
+	for (uint32_t i = 0; i < header->nr_sequences; i++) {
+		const struct cache_sequence *src = &image->sequences[i];
+		struct sequence *sequence = &config->sequences[i];
+		memcpy(arena.sequence_keys,
+		       &image->sequence_keys[src->first_key],
+		       src->nr_keys * sizeof(uint32_t));
+		*sequence = (struct sequence){
+			.keycodes = arena.sequence_keys,
+			.nr_keys = src->nr_keys,
+			.timeout = src->timeout,
+			.on_match = get_action(image, &arena, strings,
+					       &src->on_match),
+		};
+		arena.sequence_keys += src->nr_keys;
+	}
+}
+
+bool
+config_cache_load(struct config *config, uint64_t hash)
+{
+	int fd = open(RYDEEN_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0
+	    || st.st_size < (off_t)sizeof(struct cache_header)) {
+		close(fd);
+		return false;
+	}
+
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	const struct cache_header *header = (struct cache_header *)data;
+	struct cache_layout layout = get_layout(header);
+	bool valid = false;
+	if (!memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic))
+	    && header->version == CACHE_VERSION && header->hash == hash
+	    && header->size == st.st_size && layout.size == header->size) {
+		struct cache_image image = map_image(data, &layout);
+		struct config_size size;
+		valid = validate_image(&image, &size);
+		if (valid)
+			read_image(config, &image, &size);
+	}
+
+	munmap(data, st.st_size);
+	return valid;
+}
@@ -4,9 +4,54 @@
 #include <linux/input-event-codes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
 #include <yaml.h>
 
+struct keyname_entry {
+	const char *keyname;
+	uint32_t keycode;
+};
+
+// Items are parsed into the lists below, and then packed into the arena
+// of the config. Strings point into the YAML document.
+struct parsed_action {
+	enum action_type type;
+	// type == ACTION_KEY
+	key_signals_t signals;
+	// type == ACTION_COMMAND
+	const char *cmd;
+	char **argv;
+};
+
+struct parsed_modifier {
+	const char *name;
+	tll(struct modifier_key) keys;
+};
+
+struct parsed_keybind {
+	uint32_t keycode;
+	modmask_t modifiers;
+	const char *device;
+	struct parsed_action on_press;
+	struct parsed_action on_release;
+};
+
+struct parsed_gesturebind {
+	int nr_fingers;
+	enum direction direction;
+	bool repeat;
+	struct parsed_action on_forward;
+	struct parsed_action on_backward;
+};
+
+struct parsed_sequence {
+	uint32_t keycodes[MAX_SEQUENCE_KEYS];
+	uint32_t nr_keys;
+	double timeout;
+	struct parsed_action on_match;
+};
+
 struct parser_context {
 	yaml_parser_t parser;
 	yaml_document_t doc;
@@ -14,16 +59,29 @@ struct parser_context {
 	struct xkb_context *xkb_ctx;
 	struct xkb_keymap *keymap;
 	struct config *config;
-};
 
-#define MAX_KEYCODE 512
+	// Open addressing hash table from keysym name to keycode
+	struct keyname_entry *keyname_table;
+	uint32_t keyname_table_mask;
+	// Name of the first keysym of each keycode
+	const char *keycode_names[MAX_KEYCODE];
+	// Keysym names at level 0 of the keymap, owned by this context
+	tll(struct keyname_entry) keynames;
+
+	tll(struct parsed_modifier) modifiers;
+	tll(struct parsed_keybind) keybinds;
+	tll(struct parsed_gesturebind) gesturebinds;
+	tll(struct parsed_sequence) sequences;
+};
 
+// Parse errors are returned up to parse_config(), which frees everything
+// parsed so far with the context
 #define PANIC(node) \
 	do { \
 		fprintf(stderr, "Falied to parse config at %ld:%ld\n", \
 			(node)->start_mark.line + 1, \
 			(node)->start_mark.column + 1); \
-		abort(); \
+		return false; \
 	} while (0)
 
 static yaml_node_t *
@@ -42,55 +100,58 @@ get_node_by_key(struct parser_context *ctx, const yaml_node_t *mapping_node,
 	return NULL;
 }
 
-static inline double
-node_to_double(yaml_node_t *node)
+static inline bool
+node_to_double(yaml_node_t *node, double *result)
 {
 	if (node->type != YAML_SCALAR_NODE)
 		PANIC(node);
 
 	char *cast_err;
-	double result = strtod((char *)node->data.scalar.value, &cast_err);
+	*result = strtod((char *)node->data.scalar.value, &cast_err);
 	if (*cast_err)
 		PANIC(node);
-	return result;
+	return true;
 }
 
-static inline int
-node_to_int(yaml_node_t *node)
+static inline bool
+node_to_int(yaml_node_t *node, int *result)
 {
 	if (node->type != YAML_SCALAR_NODE)
 		PANIC(node);
 
 	char *cast_err;
-	long result = strtol((char *)node->data.scalar.value, &cast_err, 10);
-	if (*cast_err || result > INT_MAX || result < INT_MIN)
+	long value = strtol((char *)node->data.scalar.value, &cast_err, 10);
+	if (*cast_err || value > INT_MAX || value < INT_MIN)
 		PANIC(node);
-	return (int)result;
+	*result = (int)value;
+	return true;
 }
 
-static inline const char *
-node_to_str(yaml_node_t *node)
+static inline bool
+node_to_str(yaml_node_t *node, const char **result)
 {
 	if (node->type != YAML_SCALAR_NODE)
 		PANIC(node);
-	return (const char *)((node)->data.scalar.value);
+	*result = (const char *)((node)->data.scalar.value);
+	return true;
 }
 
 static inline bool
-node_to_bool(yaml_node_t *node)
+node_to_bool(yaml_node_t *node, bool *result)
 {
 	if (node->type != YAML_SCALAR_NODE)
 		PANIC(node);
 	char *str = (char *)node->data.scalar.value;
 	if (!strcmp(str, "true"))
-		return true;
+		*result = true;
 	else if (!strcmp(str, "false"))
-		return false;
+		*result = false;
 	else
 		PANIC(node);
+	return true;
 }
 
-struct keycode_keyname_pair {
+static const struct {
 	uint32_t keycode;
 	const char *keyname;
 } mouse_keysyms[] = {
@@ -102,51 +163,178 @@ struct keycode_keyname_pair {
 };
 
 static uint32_t
-keyname_to_keycode(struct parser_context *ctx, const char *keyname)
+hash_keyname(const char *keyname)
 {
-	for (int i = 0; i < ARRAY_SIZE(mouse_keysyms); i++)
-		if (!strcmp(keyname, mouse_keysyms[i].keyname))
-			return mouse_keysyms[i].keycode;
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char *p = keyname; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash;
+}
+
+static struct keyname_entry *
+lookup_keyname(struct parser_context *ctx, const char *keyname)
+{
+	uint32_t i = hash_keyname(keyname) & ctx->keyname_table_mask;
+	for (;; i = (i + 1) & ctx->keyname_table_mask) {
+		struct keyname_entry *entry = &ctx->keyname_table[i];
+		if (!entry->keyname || !strcmp(entry->keyname, keyname))
+			return entry;
+	}
+}
+
+static void
+add_keyname(struct parser_context *ctx, const char *keyname, uint32_t keycode)
+{
+	struct keyname_entry *entry = lookup_keyname(ctx, keyname);
+	// The smallest keycode wins
+	if (!entry->keyname) {
+		entry->keyname = keyname;
+		entry->keycode = keycode;
+	}
+	if (!ctx->keycode_names[keycode])
+		ctx->keycode_names[keycode] = keyname;
+}
 
-	for (uint32_t i = 0; i < MAX_KEYCODE; i++) {
+// Walks the keymap once to index the keysym names at level 0
+static void
+build_keyname_table(struct parser_context *ctx)
+{
+	for (uint32_t i = 1; i < MAX_KEYCODE; i++) {
 		const xkb_keysym_t *syms;
 		int syms_len = xkb_keymap_key_get_syms_by_level(
 			ctx->keymap, i + 8, 0, 0, &syms);
-		if (!syms_len)
-			continue;
 		for (int j = 0; j < syms_len; j++) {
 			char sym_name[64];
-			if (!xkb_keysym_get_name(syms[j], sym_name,
-						 sizeof(sym_name)))
+			if (xkb_keysym_get_name(syms[j], sym_name,
+						sizeof(sym_name))
+			    <= 0)
 				continue;
-			if (!strcmp(sym_name, keyname))
-				return i;
+			struct keyname_entry entry = {
+				.keyname = strdup(sym_name),
+				.keycode = i,
+			};
+			tll_push_back(ctx->keynames, entry);
 		}
 	}
-	return 0;
+
+	uint32_t size = 64;
+	while (size
+	       < 2 * (tll_length(ctx->keynames) + ARRAY_SIZE(mouse_keysyms)))
+		size *= 2;
+	ctx->keyname_table = calloc(size, sizeof(*ctx->keyname_table));
+	ctx->keyname_table_mask = size - 1;
+
+	// Mouse buttons take precedence over keysyms with the same name
+	for (int i = 0; i < ARRAY_SIZE(mouse_keysyms); i++)
+		add_keyname(ctx, mouse_keysyms[i].keyname,
+			    mouse_keysyms[i].keycode);
+	tll_foreach(ctx->keynames, it)
+		add_keyname(ctx, it->item.keyname, it->item.keycode);
 }
 
-static const char *
-keycode_to_keyname(struct parser_context *ctx, uint32_t keycode)
+// Compiles the keymap of ctx->keyboard and indexes its keysym names
+static bool
+load_keymap(struct parser_context *ctx)
 {
-	for (int i = 0; i < ARRAY_SIZE(mouse_keysyms); i++)
-		if (keycode == mouse_keysyms[i].keycode)
-			return mouse_keysyms[i].keyname;
+	ctx->xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	ctx->keymap = xkb_keymap_new_from_names(
+		ctx->xkb_ctx, &ctx->keyboard, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!ctx->keymap)
+		return false;
+	build_keyname_table(ctx);
+	return true;
+}
 
-	const xkb_keysym_t *syms;
-	int syms_len = xkb_keymap_key_get_syms_by_level(
-		ctx->keymap, keycode + 8, 0, 0, &syms);
-	if (!syms_len)
-		return NULL;
+static void
+free_keymap(struct parser_context *ctx)
+{
+	free(ctx->keyname_table);
+	tll_foreach(ctx->keynames, it)
+		free((char *)it->item.keyname);
+	tll_free(ctx->keynames);
+	xkb_keymap_unref(ctx->keymap);
+	xkb_context_unref(ctx->xkb_ctx);
+}
+
+static uint64_t
+fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ ((const uint8_t *)data)[i]) * 1099511628211u;
+	return hash;
+}
+
+// Keycodes depend on the XKB data installed, not only on RMLVO
+static uint64_t
+hash_keymap(struct xkb_keymap *keymap)
+{
+	char *str = xkb_keymap_get_as_string(keymap,
+					     XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (!str)
+		return 0;
+	uint64_t hash = fnv1a(14695981039346656037u, str, strlen(str));
+	free(str);
+	return hash;
+}
 
-	static char buf[256];
-	if (!xkb_keysym_get_name(syms[0], buf, sizeof(buf)))
+// Compiles the keymap a config was resolved with again, to check that
+// its keycodes are still valid
+static bool
+is_keymap_current(const struct config *config)
+{
+	struct xkb_rule_names names = {
+		.rules = config->rmlvo[0],
+		.model = config->rmlvo[1],
+		.layout = config->rmlvo[2],
+		.variant = config->rmlvo[3],
+		.options = config->rmlvo[4],
+	};
+	struct xkb_context *xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (!xkb_ctx)
+		return false;
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(
+		xkb_ctx, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	bool current = keymap && hash_keymap(keymap) == config->keymap_hash;
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(xkb_ctx);
+	return current;
+}
+
+struct parser_context *
+config_keymap_new(void)
+{
+	struct parser_context *ctx = znew(*ctx);
+	if (!load_keymap(ctx)) {
+		config_keymap_free(ctx);
 		return NULL;
+	}
+	return ctx;
+}
 
-	return buf;
+void
+config_keymap_free(struct parser_context *ctx)
+{
+	free_keymap(ctx);
+	free(ctx);
 }
 
-static void
+uint32_t
+keyname_to_keycode(struct parser_context *ctx, const char *keyname)
+{
+	struct keyname_entry *entry = lookup_keyname(ctx, keyname);
+	return entry->keyname ? entry->keycode : 0;
+}
+
+static const char *
+keycode_to_keyname(struct parser_context *ctx, uint32_t keycode)
+{
+	if (keycode >= MAX_KEYCODE)
+		return NULL;
+	return ctx->keycode_names[keycode];
+}
+
+static bool
 parse_general(struct parser_context *ctx, const yaml_node_t *general_node)
 {
 	struct config *config = ctx->config;
@@ -155,30 +343,170 @@ parse_general(struct parser_context *ctx, const yaml_node_t *general_node)
 	yaml_node_t *key_interval_node =
 		get_node_by_key(ctx, general_node, "key_interval");
 	if (key_interval_node) {
-		config->key_interval = node_to_double(key_interval_node);
+		if (!node_to_double(key_interval_node, &config->key_interval))
+			return false;
+	}
+
+	// "general.key_action_policy"
+	yaml_node_t *key_action_policy_node =
+		get_node_by_key(ctx, general_node, "key_action_policy");
+	if (key_action_policy_node) {
+		const char *policy;
+		if (!node_to_str(key_action_policy_node, &policy))
+			return false;
+		if (!strcmp(policy, "serialize"))
+			config->key_action_policy = KEY_ACTION_SERIALIZE;
+		else if (!strcmp(policy, "interleave"))
+			config->key_action_policy = KEY_ACTION_INTERLEAVE;
+		else if (!strcmp(policy, "drop"))
+			config->key_action_policy = KEY_ACTION_DROP;
+		else
+			PANIC(key_action_policy_node);
+	}
+
+	// "general.key_action_queue"
+	yaml_node_t *key_action_queue_node =
+		get_node_by_key(ctx, general_node, "key_action_queue");
+	if (key_action_queue_node) {
+		int size;
+		if (!node_to_int(key_action_queue_node, &size))
+			return false;
+		if (size < 1)
+			PANIC(key_action_queue_node);
+		config->key_action_queue_size = size;
 	}
 
 	// "general.key_repeat_delay"
 	yaml_node_t *key_repeat_delay_node =
 		get_node_by_key(ctx, general_node, "key_repeat_delay");
 	if (key_repeat_delay_node) {
-		config->key_repeat_delay =
-			node_to_double(key_repeat_delay_node);
+		if (!node_to_double(key_repeat_delay_node,
+				    &config->key_repeat_delay))
+			return false;
 	}
 
 	// "general.key_repeat_interval"
 	yaml_node_t *key_repeat_interval_node =
 		get_node_by_key(ctx, general_node, "key_repeat_interval");
 	if (key_repeat_interval_node) {
-		config->key_repeat_interval =
-			node_to_double(key_repeat_interval_node);
+		if (!node_to_double(key_repeat_interval_node,
+				    &config->key_repeat_interval))
+			return false;
+	}
+
+	// "general.tap_timeout"
+	yaml_node_t *tap_timeout_node =
+		get_node_by_key(ctx, general_node, "tap_timeout");
+	if (tap_timeout_node) {
+		if (!node_to_double(tap_timeout_node, &config->tap_timeout))
+			return false;
+		if (config->tap_timeout <= 0.)
+			PANIC(tap_timeout_node);
+	}
+
+	// "general.spawn_helper"
+	yaml_node_t *spawn_helper_node =
+		get_node_by_key(ctx, general_node, "spawn_helper");
+	if (spawn_helper_node) {
+		if (!node_to_bool(spawn_helper_node, &config->spawn_helper))
+			return false;
+	}
+
+	// "general.action_thread"
+	yaml_node_t *action_thread_node =
+		get_node_by_key(ctx, general_node, "action_thread");
+	if (action_thread_node) {
+		if (!node_to_bool(action_thread_node, &config->action_thread))
+			return false;
+	}
+
+	// "general.direct_keyboards"
+	yaml_node_t *direct_keyboards_node =
+		get_node_by_key(ctx, general_node, "direct_keyboards");
+	if (direct_keyboards_node) {
+		if (!node_to_bool(direct_keyboards_node,
+				  &config->direct_keyboards))
+			return false;
+	}
+
+	// "general.realtime_priority"
+	yaml_node_t *realtime_priority_node =
+		get_node_by_key(ctx, general_node, "realtime_priority");
+	if (realtime_priority_node) {
+		int priority;
+		if (!node_to_int(realtime_priority_node, &priority))
+			return false;
+		if (priority < 0 || priority > 99)
+			PANIC(realtime_priority_node);
+		config->realtime_priority = priority;
+	}
+
+	// "general.lock_memory"
+	yaml_node_t *lock_memory_node =
+		get_node_by_key(ctx, general_node, "lock_memory");
+	if (lock_memory_node) {
+		if (!node_to_bool(lock_memory_node, &config->lock_memory))
+			return false;
+	}
+
+	// "general.cpu_affinity"
+	yaml_node_t *cpu_affinity_node =
+		get_node_by_key(ctx, general_node, "cpu_affinity");
+	if (cpu_affinity_node) {
+		if (cpu_affinity_node->type != YAML_SEQUENCE_NODE)
+			PANIC(cpu_affinity_node);
+		for (yaml_node_item_t *cpu_node_id =
+			     cpu_affinity_node->data.sequence.items.start;
+		     cpu_node_id < cpu_affinity_node->data.sequence.items.top;
+		     cpu_node_id++) {
+			// "general.cpu_affinity[*]"
+			yaml_node_t *cpu_node =
+				yaml_document_get_node(&ctx->doc, *cpu_node_id);
+			int cpu;
+			if (!node_to_int(cpu_node, &cpu))
+				return false;
+			if (cpu < 0 || cpu >= 64)
+				PANIC(cpu_node);
+			config->cpu_affinity |= (uint64_t)1 << cpu;
+		}
 	}
 
 	// "general.swipe_threshold"
 	yaml_node_t *swipe_thr_node =
 		get_node_by_key(ctx, general_node, "swipe_threshold");
 	if (swipe_thr_node) {
-		config->swipe_thr = node_to_double(swipe_thr_node);
+		if (!node_to_double(swipe_thr_node, &config->swipe_thr))
+			return false;
+	}
+
+	// "general.swipe_velocity"
+	yaml_node_t *swipe_velocity_node =
+		get_node_by_key(ctx, general_node, "swipe_velocity");
+	if (swipe_velocity_node) {
+		if (!node_to_double(swipe_velocity_node,
+				    &config->swipe_velocity))
+			return false;
+		if (config->swipe_velocity < 0.)
+			PANIC(swipe_velocity_node);
+	}
+
+	// "general.swipe_min_distance"
+	yaml_node_t *swipe_min_distance_node =
+		get_node_by_key(ctx, general_node, "swipe_min_distance");
+	if (swipe_min_distance_node) {
+		if (!node_to_double(swipe_min_distance_node,
+				    &config->swipe_min_distance))
+			return false;
+	}
+
+	// "general.swipe_angle"
+	yaml_node_t *swipe_angle_node =
+		get_node_by_key(ctx, general_node, "swipe_angle");
+	if (swipe_angle_node) {
+		if (!node_to_double(swipe_angle_node, &config->swipe_angle))
+			return false;
+		if (config->swipe_angle < 0. || config->swipe_angle > 45.)
+			PANIC(swipe_angle_node);
 	}
 
 	// "general.keyboard"
@@ -188,38 +516,52 @@ parse_general(struct parser_context *ctx, const yaml_node_t *general_node)
 		// "general.keyboard.rules"
 		yaml_node_t *rules_node =
 			get_node_by_key(ctx, keyboard_node, "rules");
-		if (rules_node)
-			ctx->keyboard.rules = node_to_str(rules_node);
+		if (rules_node
+		    && !node_to_str(rules_node, &ctx->keyboard.rules))
+			return false;
 		// "general.keyboard.model"
 		yaml_node_t *model_node =
 			get_node_by_key(ctx, keyboard_node, "model");
-		if (model_node)
-			ctx->keyboard.model = node_to_str(model_node);
+		if (model_node
+		    && !node_to_str(model_node, &ctx->keyboard.model))
+			return false;
 		// "general.keyboard.layout"
 		yaml_node_t *layout_node =
 			get_node_by_key(ctx, keyboard_node, "layout");
-		if (layout_node)
-			ctx->keyboard.layout = node_to_str(layout_node);
+		if (layout_node && !node_to_str(layout_node,
+						&ctx->keyboard.layout))
+			return false;
 		// "general.keyboard.variant"
 		yaml_node_t *variant_node =
 			get_node_by_key(ctx, keyboard_node, "variant");
-		if (variant_node)
-			ctx->keyboard.variant = node_to_str(variant_node);
+		if (variant_node
+		    && !node_to_str(variant_node, &ctx->keyboard.variant))
+			return false;
 		// "general.keyboard.options"
 		yaml_node_t *options_node =
 			get_node_by_key(ctx, keyboard_node, "options");
-		if (options_node)
-			ctx->keyboard.options = node_to_str(options_node);
+		if (options_node
+		    && !node_to_str(options_node, &ctx->keyboard.options))
+			return false;
 	}
+	return true;
 }
 
-static void
+static bool
 parse_modifier(struct parser_context *ctx, const yaml_node_pair_t *modifier_kv)
 {
-	struct modifier modifier = {0};
+	if (tll_length(ctx->modifiers) >= MAX_MODIFIERS) {
+		fprintf(stderr, "Up to %d modifiers are allowed\n",
+			MAX_MODIFIERS);
+		PANIC(yaml_document_get_node(&ctx->doc, modifier_kv->key));
+	}
 
-	modifier.name = strdup(node_to_str(
-		yaml_document_get_node(&ctx->doc, modifier_kv->key)));
+	// Filled in place so that it's freed with the context on errors
+	tll_push_back(ctx->modifiers, (struct parsed_modifier){0});
+	struct parsed_modifier *modifier = &ctx->modifiers.tail->item;
+	if (!node_to_str(yaml_document_get_node(&ctx->doc, modifier_kv->key),
+			 &modifier->name))
+		return false;
 
 	// "modifiers.(modifier_name)"
 	yaml_node_t *modifier_val_node =
@@ -239,9 +581,13 @@ parse_modifier(struct parser_context *ctx, const yaml_node_pair_t *modifier_kv)
 		// "modifiers.(modifier_name)[*].key"
 		yaml_node_t *key_node =
 			get_node_by_key(ctx, modifier_item_node, "key");
-		const char *key_name = node_to_str(key_node);
+		if (!key_node)
+			PANIC(modifier_item_node);
+		const char *key_name;
+		if (!node_to_str(key_node, &key_name))
+			return false;
 		uint32_t keycode = keyname_to_keycode(ctx, key_name);
-		if (!keycode)
+		if (!keycode || keycode >= MAX_KEYCODE)
 			PANIC(key_node);
 
 		struct modifier_key mod_key = {0};
@@ -252,7 +598,9 @@ parse_modifier(struct parser_context *ctx, const yaml_node_pair_t *modifier_kv)
 		yaml_node_t *send_key_node =
 			get_node_by_key(ctx, modifier_item_node, "send_key");
 		if (send_key_node) {
-			const char *send_key_str = node_to_str(send_key_node);
+			const char *send_key_str;
+			if (!node_to_str(send_key_node, &send_key_str))
+				return false;
 			if (!strcmp(send_key_str, "false"))
 				mod_key.send_keycode = 0;
 			else {
@@ -267,24 +615,36 @@ parse_modifier(struct parser_context *ctx, const yaml_node_pair_t *modifier_kv)
 			// always don't send for mouse-button modifiers
 			mod_key.send_keycode = 0;
 
-		tll_push_back(modifier.keys, mod_key);
+		// "modifiers.(modifier_name)[*].tap"
+		yaml_node_t *tap_node =
+			get_node_by_key(ctx, modifier_item_node, "tap");
+		if (tap_node && keycode < 256) {
+			const char *tap_str;
+			if (!node_to_str(tap_node, &tap_str))
+				return false;
+			mod_key.tap_keycode = keyname_to_keycode(ctx, tap_str);
+			if (!mod_key.tap_keycode)
+				PANIC(tap_node);
+		}
+
+		tll_push_back(modifier->keys, mod_key);
 	}
-	tll_push_back(ctx->config->modifiers, modifier);
+	return true;
 }
 
-static key_signals_t
-parse_key_signals(struct parser_context *ctx, yaml_node_t *key_action_node)
+static bool
+parse_key_signals(struct parser_context *ctx, yaml_node_t *key_action_node,
+		  key_signals_t *signals)
 {
-	key_signals_t result = {0};
 	for (yaml_node_item_t *item =
 		     key_action_node->data.sequence.items.start;
 	     item < key_action_node->data.sequence.items.top; item++) {
 		// (keybinds|gesturebinds)[*].(on_press|on_release|on_forward|on_backward)[*]
 		yaml_node_t *elem_node =
 			yaml_document_get_node(&ctx->doc, *item);
-		if (elem_node->type != YAML_SCALAR_NODE)
-			PANIC(elem_node);
-		const char *key_signal_str = node_to_str(elem_node);
+		const char *key_signal_str;
+		if (!node_to_str(elem_node, &key_signal_str))
+			return false;
 
 		enum {
 			SIGNAL_PRESS = 1,
@@ -310,52 +670,166 @@ parse_key_signals(struct parser_context *ctx, yaml_node_t *key_action_node)
 
 		struct key_signal signal = {.keycode = keycode, .press = true};
 		if (signal_type & SIGNAL_PRESS)
-			tll_push_back(result, signal);
+			tll_push_back(*signals, signal);
 		signal.press = false;
 		if (signal_type & SIGNAL_RELEASE)
-			tll_push_back(result, signal);
+			tll_push_back(*signals, signal);
 	}
-	return result;
+	return true;
+}
+
+// Reserved words and builtins of POSIX sh and bash. Utilities which are
+// also installed as programs, such as test, are included as the shell
+// runs its builtin rather than the program.
+static bool
+is_shell_builtin(const char *word)
+{
+	static const char *builtins[] = {
+		"!", ".", ":", "[", "[[", "alias", "bg", "break", "builtin",
+		"caller", "case", "cd", "command", "compgen", "complete",
+		"continue", "coproc", "declare", "dirs", "disown", "do", "done",
+		"echo", "elif", "else", "enable", "esac", "eval", "exec",
+		"exit", "export", "false", "fc", "fg", "fi", "for", "function",
+		"getopts", "hash", "help", "history", "if", "in", "jobs",
+		"kill", "let", "local", "logout", "mapfile", "newgrp", "popd",
+		"printf", "pushd", "pwd", "read", "readarray", "readonly",
+		"return", "select", "set", "shift", "shopt", "source",
+		"suspend", "test", "then", "time", "times", "trap", "true",
+		"type", "typeset", "ulimit", "umask", "unalias", "unset",
+		"until", "wait", "while", "{", "}",
+	};
+	for (int i = 0; i < ARRAY_SIZE(builtins); i++)
+		if (!strcmp(word, builtins[i]))
+			return true;
+	return false;
 }
 
-static key_signals_t
+// Splits cmd into words. Returns NULL if cmd uses any shell feature other
+// than quoting, so it needs to be run by shell.
+static char **
+split_command(const char *cmd)
+{
+	tll(char *) words = tll_init();
+	char *word = malloc(strlen(cmd) + 1);
+	size_t len = 0;
+	bool in_word = false;
+	bool needs_shell = false;
+
+	for (const char *p = cmd; !needs_shell; p++) {
+		if (*p == '\0' || *p == ' ' || *p == '\t') {
+			if (in_word) {
+				word[len] = '\0';
+				tll_push_back(words, strdup(word));
+				len = 0;
+				in_word = false;
+			}
+			if (*p == '\0')
+				break;
+		} else if (*p == '\'' || *p == '"') {
+			const char *end = strchr(p + 1, *p);
+			if (!end) {
+				needs_shell = true;
+				break;
+			}
+			for (p++; p < end; p++) {
+				if (*end == '"' && strchr("$`\\", *p))
+					needs_shell = true;
+				word[len++] = *p;
+			}
+			in_word = true;
+		} else if (strchr("|&;<>()$`\\*?[]{}~#!\n\r", *p)) {
+			// Newlines separate commands like ';'
+			needs_shell = true;
+		} else if (*p == '=' && tll_length(words) == 0) {
+			// variable assignment
+			needs_shell = true;
+		} else {
+			word[len++] = *p;
+			in_word = true;
+		}
+	}
+	free(word);
+
+	if (tll_length(words) == 0 || is_shell_builtin(words.head->item))
+		needs_shell = true;
+
+	char **argv = NULL;
+	if (!needs_shell) {
+		argv = calloc(tll_length(words) + 1, sizeof(*argv));
+		int i = 0;
+		tll_foreach(words, it)
+			argv[i++] = it->item;
+		tll_free(words);
+	} else {
+		tll_free_and_free(words, free);
+	}
+	return argv;
+}
+
+static void
+parse_command(struct parsed_action *action, yaml_node_t *cmd_node)
+{
+	const char *cmd = (const char *)cmd_node->data.scalar.value;
+	action->type = ACTION_COMMAND;
+	action->cmd = cmd;
+	action->argv = split_command(cmd);
+}
+
+key_signals_t
 get_undo_key_signals(key_signals_t *signals)
 {
-	struct ryd_set pressed_keys = {0};
+	// Keys left pressed, in the order they were pressed
+	struct ryd_keyset pressed_keys = {0};
+	uint32_t *pressed_order =
+		calloc(tll_length(*signals) + 1, sizeof(*pressed_order));
+	size_t nr_pressed = 0;
+
 	tll_foreach(*signals, it) {
-		if (it->item.press)
-			ryd_set_add(&pressed_keys, it->item.keycode);
-		else
-			ryd_set_remove(&pressed_keys, it->item.keycode);
+		uint32_t keycode = it->item.keycode;
+		if (it->item.press) {
+			if (ryd_keyset_add(&pressed_keys, keycode))
+				pressed_order[nr_pressed++] = keycode;
+		} else if (ryd_keyset_remove(&pressed_keys, keycode)) {
+			size_t i = 0;
+			while (pressed_order[i] != keycode)
+				i++;
+			memmove(&pressed_order[i], &pressed_order[i + 1],
+				(nr_pressed - i - 1) * sizeof(*pressed_order));
+			nr_pressed--;
+		}
 	}
 
 	key_signals_t result = {0};
-	for (int i = pressed_keys.size - 1; i >= 0; i--) {
+	for (size_t i = nr_pressed; i > 0; i--) {
 		struct key_signal signal = {
-			.keycode = pressed_keys.values[i],
+			.keycode = pressed_order[i - 1],
 			.press = false,
 		};
 		tll_push_back(result, signal);
 	}
 
+	free(pressed_order);
 	return result;
 }
 
-static void
+static bool
 parse_keybind(struct parser_context *ctx, yaml_node_t *keybind_node)
 {
-	struct keybind keybind = {0};
+	tll_push_back(ctx->keybinds, (struct parsed_keybind){0});
+	struct parsed_keybind *keybind = &ctx->keybinds.tail->item;
 
 	// "keybinds[*].key"
 	yaml_node_t *key_node = get_node_by_key(ctx, keybind_node, "key");
 	if (!key_node)
 		PANIC(keybind_node);
-	const char *key = node_to_str(key_node);
+	const char *key;
+	if (!node_to_str(key_node, &key))
+		return false;
 	uint32_t keycode = keyname_to_keycode(ctx, key);
 	if (!keycode || keycode >= MAX_KEYCODE)
 		PANIC(key_node);
 
-	keybind.keycode = keycode;
+	keybind->keycode = keycode;
 
 	// "keybinds[*].modifiers"
 	yaml_node_t *modifiers_node =
@@ -370,34 +844,43 @@ parse_keybind(struct parser_context *ctx, yaml_node_t *keybind_node)
 			// "entries.[*].modifiers[*]"
 			yaml_node_t *modifier_node = yaml_document_get_node(
 				&ctx->doc, *modifier_node_id);
-			const char *modifier_name = node_to_str(modifier_node);
+			const char *modifier_name;
+			if (!node_to_str(modifier_node, &modifier_name))
+				return false;
 
-			struct modifier *modifier = NULL;
-			tll_foreach(ctx->config->modifiers, it) {
+			int index = 0;
+			bool found = false;
+			tll_foreach(ctx->modifiers, it) {
 				if (!strcmp(it->item.name, modifier_name)) {
-					modifier = &it->item;
+					found = true;
 					break;
 				}
+				index++;
 			}
-			if (!modifier)
+			if (!found)
 				PANIC(modifier_node);
 
-			tll_push_back(keybind.modifiers, modifier);
+			keybind->modifiers |= (modmask_t)1 << index;
 		};
 	}
 
+	// "keybinds[*].device"
+	yaml_node_t *device_node = get_node_by_key(ctx, keybind_node, "device");
+	if (device_node && !node_to_str(device_node, &keybind->device))
+		return false;
+
 	// "gesturebinds[*].on_press"
 	yaml_node_t *on_press_node =
 		get_node_by_key(ctx, keybind_node, "on_press");
 	if (!on_press_node)
 		PANIC(keybind_node);
 	if (on_press_node->type == YAML_SEQUENCE_NODE) {
-		keybind.on_press.type = ACTION_KEY,
-		keybind.on_press.signals =
-			parse_key_signals(ctx, on_press_node);
+		keybind->on_press.type = ACTION_KEY;
+		if (!parse_key_signals(ctx, on_press_node,
+				       &keybind->on_press.signals))
+			return false;
 	} else if (on_press_node->type == YAML_SCALAR_NODE) {
-		keybind.on_press.type = ACTION_COMMAND;
-		keybind.on_press.cmd = strdup(node_to_str(on_press_node));
+		parse_command(&keybind->on_press, on_press_node);
 	} else {
 		PANIC(on_press_node);
 	}
@@ -408,35 +891,38 @@ parse_keybind(struct parser_context *ctx, yaml_node_t *keybind_node)
 	if (!on_release_node) {
 		// if on_release is undefined and on_press is key sequence,
 		// set release action to key action that undoes pressed keys.
-		if (keybind.on_press.type == ACTION_KEY) {
-			keybind.on_release.type = ACTION_KEY;
-			keybind.on_release.signals =
-				get_undo_key_signals(&keybind.on_press.signals);
+		if (keybind->on_press.type == ACTION_KEY) {
+			keybind->on_release.type = ACTION_KEY;
+			keybind->on_release.signals =
+				get_undo_key_signals(
+					&keybind->on_press.signals);
 		}
 	} else if (on_release_node->type == YAML_SEQUENCE_NODE) {
-		keybind.on_release.type = ACTION_KEY;
-		keybind.on_release.signals =
-			parse_key_signals(ctx, on_release_node);
+		keybind->on_release.type = ACTION_KEY;
+		if (!parse_key_signals(ctx, on_release_node,
+				       &keybind->on_release.signals))
+			return false;
 	} else if (on_release_node->type == YAML_SCALAR_NODE) {
-		keybind.on_release.type = ACTION_COMMAND;
-		keybind.on_release.cmd = strdup(node_to_str(on_release_node));
+		parse_command(&keybind->on_release, on_release_node);
 	} else {
 		PANIC(on_release_node);
 	}
-
-	tll_push_back(ctx->config->keybinds, keybind);
+	return true;
 }
 
-static void
+static bool
 parse_gesturebind(struct parser_context *ctx, yaml_node_t *bind_node)
 {
-	struct gesturebind bind = {.repeat = false};
+	tll_push_back(ctx->gesturebinds, (struct parsed_gesturebind){0});
+	struct parsed_gesturebind *bind = &ctx->gesturebinds.tail->item;
 
 	// "gesturebinds[*].gesture"
 	yaml_node_t *gesture_node = get_node_by_key(ctx, bind_node, "gesture");
 	if (!gesture_node)
 		PANIC(bind_node);
-	const char *gesture_str = node_to_str(gesture_node);
+	const char *gesture_str;
+	if (!node_to_str(gesture_node, &gesture_str))
+		return false;
 	if (strcmp(gesture_str, "swipe")) {
 		fprintf(stderr,
 			"Only \"swipe\" gesture is currently implemented\n");
@@ -447,8 +933,9 @@ parse_gesturebind(struct parser_context *ctx, yaml_node_t *bind_node)
 	yaml_node_t *fingers_node = get_node_by_key(ctx, bind_node, "fingers");
 	if (!fingers_node)
 		PANIC(bind_node);
-	bind.nr_fingers = node_to_int(fingers_node);
-	if (bind.nr_fingers != 3 && bind.nr_fingers != 4) {
+	if (!node_to_int(fingers_node, &bind->nr_fingers))
+		return false;
+	if (bind->nr_fingers != 3 && bind->nr_fingers != 4) {
 		fprintf(stderr, "3 or 4 is only allowed in \"fingers\"\n");
 		PANIC(fingers_node);
 	}
@@ -458,22 +945,25 @@ parse_gesturebind(struct parser_context *ctx, yaml_node_t *bind_node)
 		get_node_by_key(ctx, bind_node, "direction");
 	if (!direction_node)
 		PANIC(bind_node);
-	const char *direction_str = node_to_str(direction_node);
+	const char *direction_str;
+	if (!node_to_str(direction_node, &direction_str))
+		return false;
 	if (!strcmp(direction_str, "up"))
-		bind.direction = DIRECTION_UP;
+		bind->direction = DIRECTION_UP;
 	else if (!strcmp(direction_str, "down"))
-		bind.direction = DIRECTION_DOWN;
+		bind->direction = DIRECTION_DOWN;
 	else if (!strcmp(direction_str, "left"))
-		bind.direction = DIRECTION_LEFT;
+		bind->direction = DIRECTION_LEFT;
 	else if (!strcmp(direction_str, "right"))
-		bind.direction = DIRECTION_RIGHT;
+		bind->direction = DIRECTION_RIGHT;
 	else
 		PANIC(direction_node);
 
 	// "gesturebinds[*].repeat"
 	yaml_node_t *repeat_node = get_node_by_key(ctx, bind_node, "repeat");
 	if (repeat_node)
-		bind.repeat = node_to_bool(repeat_node);
+		if (!node_to_bool(repeat_node, &bind->repeat))
+			return false;
 
 	// "gesturebinds[*].on_forward"
 	yaml_node_t *on_forward_node =
@@ -481,12 +971,12 @@ parse_gesturebind(struct parser_context *ctx, yaml_node_t *bind_node)
 	if (!on_forward_node)
 		PANIC(bind_node);
 	if (on_forward_node->type == YAML_SEQUENCE_NODE) {
-		bind.on_forward.type = ACTION_KEY;
-		bind.on_forward.signals =
-			parse_key_signals(ctx, on_forward_node);
+		bind->on_forward.type = ACTION_KEY;
+		if (!parse_key_signals(ctx, on_forward_node,
+				       &bind->on_forward.signals))
+			return false;
 	} else if (on_forward_node->type == YAML_SCALAR_NODE) {
-		bind.on_forward.type = ACTION_COMMAND;
-		bind.on_forward.cmd = strdup(node_to_str(on_forward_node));
+		parse_command(&bind->on_forward, on_forward_node);
 	} else {
 		PANIC(on_forward_node);
 	}
@@ -495,42 +985,567 @@ parse_gesturebind(struct parser_context *ctx, yaml_node_t *bind_node)
 	yaml_node_t *on_backward_node =
 		get_node_by_key(ctx, bind_node, "on_backward");
 	if (!on_backward_node) {
-		if (bind.on_forward.type == ACTION_KEY) {
+		if (bind->on_forward.type == ACTION_KEY) {
 			key_signals_t undo_signals =
-				get_undo_key_signals(&bind.on_forward.signals);
+				get_undo_key_signals(&bind->on_forward.signals);
 			tll_foreach(undo_signals, it)
-				tll_push_back(bind.on_forward.signals,
+				tll_push_back(bind->on_forward.signals,
 					      it->item);
 			tll_free(undo_signals);
 		}
 	} else if (on_backward_node->type == YAML_SEQUENCE_NODE) {
-		bind.on_backward.type = ACTION_KEY;
-		bind.on_backward.signals =
-			parse_key_signals(ctx, on_backward_node);
+		bind->on_backward.type = ACTION_KEY;
+		if (!parse_key_signals(ctx, on_backward_node,
+				       &bind->on_backward.signals))
+			return false;
 	} else if (on_backward_node->type == YAML_SCALAR_NODE) {
-		bind.on_backward.type = ACTION_COMMAND;
-		bind.on_backward.cmd = strdup(node_to_str(on_backward_node));
+		parse_command(&bind->on_backward, on_backward_node);
 	} else {
 		PANIC(on_backward_node);
 	}
+	return true;
+}
+
+static bool
+parse_sequence(struct parser_context *ctx, yaml_node_t *sequence_node)
+{
+	tll_push_back(ctx->sequences, (struct parsed_sequence){0});
+	struct parsed_sequence *sequence = &ctx->sequences.tail->item;
+
+	// "sequences[*].keys"
+	yaml_node_t *keys_node = get_node_by_key(ctx, sequence_node, "keys");
+	if (!keys_node || keys_node->type != YAML_SEQUENCE_NODE)
+		PANIC(sequence_node);
+	for (yaml_node_item_t *key_node_id =
+		     keys_node->data.sequence.items.start;
+	     key_node_id < keys_node->data.sequence.items.top; key_node_id++) {
+		// "sequences[*].keys[*]"
+		yaml_node_t *key_node =
+			yaml_document_get_node(&ctx->doc, *key_node_id);
+		const char *key;
+		if (!node_to_str(key_node, &key))
+			return false;
+		uint32_t keycode = keyname_to_keycode(ctx, key);
+		if (!keycode || keycode >= MAX_KEYCODE
+		    || sequence->nr_keys == MAX_SEQUENCE_KEYS)
+			PANIC(key_node);
+		sequence->keycodes[sequence->nr_keys++] = keycode;
+	}
+	if (!sequence->nr_keys)
+		PANIC(keys_node);
+
+	// The matcher runs the first sequence it completes
+	tll_foreach(ctx->sequences, it) {
+		const struct parsed_sequence *other = &it->item;
+		if (other == sequence)
+			break;
+		uint32_t nr_keys = other->nr_keys < sequence->nr_keys
+					   ? other->nr_keys
+					   : sequence->nr_keys;
+		if (!memcmp(other->keycodes, sequence->keycodes,
+			    nr_keys * sizeof(uint32_t))) {
+			fprintf(stderr, "A sequence can't begin with another "
+					"sequence\n");
+			PANIC(keys_node);
+		}
+	}
+
+	// "sequences[*].timeout"
+	sequence->timeout = 1.;
+	yaml_node_t *timeout_node =
+		get_node_by_key(ctx, sequence_node, "timeout");
+	if (timeout_node) {
+		if (!node_to_double(timeout_node, &sequence->timeout))
+			return false;
+		if (sequence->timeout <= 0.)
+			PANIC(timeout_node);
+	}
+
+	// "sequences[*].on_match"
+	yaml_node_t *on_match_node =
+		get_node_by_key(ctx, sequence_node, "on_match");
+	if (!on_match_node)
+		PANIC(sequence_node);
+	if (on_match_node->type == YAML_SEQUENCE_NODE) {
+		sequence->on_match.type = ACTION_KEY;
+		if (!parse_key_signals(ctx, on_match_node,
+				       &sequence->on_match.signals))
+			return false;
+		// Nothing is released later, so the keys are released here
+		key_signals_t undo_signals =
+			get_undo_key_signals(&sequence->on_match.signals);
+		tll_foreach(undo_signals, it)
+			tll_push_back(sequence->on_match.signals, it->item);
+		tll_free(undo_signals);
+	} else if (on_match_node->type == YAML_SCALAR_NODE) {
+		parse_command(&sequence->on_match, on_match_node);
+	} else {
+		PANIC(on_match_node);
+	}
+	return true;
+}
+
+static bool
+keybind_applies(const struct keybind *keybind,
+		const struct input_device *device)
+{
+	if (!keybind->device)
+		return true;
+	return device && input_device_matches(device, keybind->device);
+}
+
+void
+config_build_keybind_index(const struct config *config,
+			   const struct input_device *device,
+			   struct keybind **index, uint32_t *offsets)
+{
+	memset(offsets, 0, (MAX_KEYCODE + 1) * sizeof(*offsets));
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		const struct keybind *keybind = &config->keybinds[i];
+		if (keybind_applies(keybind, device))
+			offsets[keybind->keycode + 1]++;
+	}
+	for (int i = 0; i < MAX_KEYCODE; i++)
+		offsets[i + 1] += offsets[i];
+
+	// Fill each group from its end so that later keybinds come first
+	uint32_t cursors[MAX_KEYCODE];
+	memcpy(cursors, &offsets[1], sizeof(cursors));
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		struct keybind *keybind = &config->keybinds[i];
+		if (!keybind_applies(keybind, device))
+			continue;
+		uint32_t pos = --cursors[keybind->keycode];
+		index[pos] = keybind;
+	}
+}
+
+static void
+build_modifier_index(struct config *config)
+{
+	for (uint32_t i = 0; i < config->nr_modifiers; i++) {
+		const struct modifier *modifier = &config->modifiers[i];
+		for (uint32_t j = 0; j < modifier->nr_keys; j++) {
+			const struct modifier_key *key = &modifier->keys[j];
+			config->modifier_masks[key->keycode] |= (modmask_t)1
+								<< i;
+			if (!config->modifier_keys[key->keycode])
+				config->modifier_keys[key->keycode] = key;
+		}
+	}
+
+	uint32_t *offsets = config->modifier_keybind_offsets;
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		modmask_t mask = config->keybinds[i].modifiers;
+		while (mask) {
+			offsets[__builtin_ctzll(mask) + 1]++;
+			mask &= mask - 1;
+		}
+	}
+	for (int i = 0; i < MAX_MODIFIERS; i++)
+		offsets[i + 1] += offsets[i];
+
+	uint32_t cursors[MAX_MODIFIERS];
+	memcpy(cursors, offsets, sizeof(cursors));
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		struct keybind *keybind = &config->keybinds[i];
+		modmask_t mask = keybind->modifiers;
+		while (mask) {
+			uint32_t pos = cursors[__builtin_ctzll(mask)]++;
+			config->modifier_keybind_index[pos] = keybind;
+			mask &= mask - 1;
+		}
+	}
+}
+
+// Compiles the signals of a key action into the events written at once
+// by uinput_send_action()
+static void
+compile_key_action(struct action *action, struct input_event **events,
+		   struct action_write **writes)
+{
+	if (action->type != ACTION_KEY)
+		return;
+
+	struct action_write *write = NULL;
+	action->writes = *writes;
+	for (uint32_t i = 0; i < action->nr_signals; i++) {
+		const struct key_signal *signal = &action->signals[i];
+		enum output_device device = get_output_device(signal->keycode);
+		if (!write || write->device != device) {
+			write = (*writes)++;
+			*write = (struct action_write){
+				.device = device,
+				.events = *events,
+			};
+			action->nr_writes++;
+		}
+		*(*events)++ = (struct input_event){
+			.type = EV_KEY,
+			.code = signal->keycode,
+			.value = signal->press,
+		};
+		*(*events)++ = (struct input_event){
+			.type = EV_SYN,
+			.code = SYN_REPORT,
+		};
+		write->nr_events += 2;
+
+		// Follows the repeat timer of uinput_send()
+		if (device != OUTPUT_KEYBOARD)
+			continue;
+		if (signal->press) {
+			action->presses_key = true;
+			action->repeat_keycode = signal->keycode;
+		} else if (action->repeat_keycode == signal->keycode) {
+			action->repeat_keycode = 0;
+		}
+	}
+}
+
+static inline uint32_t
+hash_transition(uint32_t state, uint32_t keycode)
+{
+	return state * 0x9e3779b1u ^ keycode;
+}
+
+uint32_t
+config_sequence_next(const struct config *config, uint32_t state,
+		     uint32_t keycode)
+{
+	if (!config->nr_sequences)
+		return 0;
+	uint32_t mask = config->sequence_table_mask;
+	for (uint32_t i = hash_transition(state, keycode) & mask;;
+	     i = (i + 1) & mask) {
+		const struct sequence_transition *transition =
+			&config->sequence_table[i];
+		if (!transition->next)
+			return 0;
+		if (transition->state == state
+		    && transition->keycode == keycode)
+			return transition->next;
+	}
+}
+
+// Returns the size of the hash table for nr_keys transitions, which keeps
+// it at most half full
+static uint32_t
+get_sequence_table_size(uint32_t nr_keys)
+{
+	uint32_t size = 1;
+	while (size < 2 * nr_keys)
+		size *= 2;
+	return size;
+}
+
+// Builds the trie of the sequences, so that each key advances the matcher
+// with one lookup however many sequences there are
+static void
+build_sequence_matcher(struct config *config)
+{
+	uint32_t nr_states = 1;
+	for (uint32_t i = 0; i < config->nr_sequences; i++) {
+		const struct sequence *sequence = &config->sequences[i];
+		uint32_t state = 0;
+		for (uint32_t j = 0; j < sequence->nr_keys; j++) {
+			uint32_t keycode = sequence->keycodes[j];
+			uint32_t next =
+				config_sequence_next(config, state, keycode);
+			if (!next) {
+				next = nr_states++;
+				uint32_t mask = config->sequence_table_mask;
+				uint32_t slot =
+					hash_transition(state, keycode) & mask;
+				while (config->sequence_table[slot].next)
+					slot = (slot + 1) & mask;
+				config->sequence_table[slot] =
+					(struct sequence_transition){
+						.state = state,
+						.keycode = keycode,
+						.next = next,
+					};
+			}
+			struct sequence_state *next_state =
+				&config->sequence_states[next];
+			if (sequence->timeout > next_state->timeout)
+				next_state->timeout = sequence->timeout;
+			state = next;
+		}
+		config->sequence_states[state].match = sequence;
+	}
+}
+
+// Fills the fields derived from the parsed or cached config
+static void
+resolve_config(struct config *config)
+{
+	config_build_keybind_index(config, NULL, config->keybind_index,
+				   config->keybind_offsets);
+	build_modifier_index(config);
+	build_sequence_matcher(config);
+
+	struct input_event *events = config->action_events;
+	struct action_write *writes = config->action_writes;
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		struct keybind *keybind = &config->keybinds[i];
+		compile_key_action(&keybind->on_press, &events, &writes);
+		compile_key_action(&keybind->on_release, &events, &writes);
+	}
+	for (uint32_t i = 0; i < config->nr_gesturebinds; i++) {
+		struct gesturebind *bind = &config->gesturebinds[i];
+		compile_key_action(&bind->on_forward, &events, &writes);
+		compile_key_action(&bind->on_backward, &events, &writes);
+	}
+	for (uint32_t i = 0; i < config->nr_sequences; i++) {
+		compile_key_action(&config->sequences[i].on_match, &events,
+				   &writes);
+	}
+}
+
+// Returns the offset of nr items of item_size bytes appended to the arena
+static size_t
+reserve(size_t *arena_size, size_t nr, size_t item_size)
+{
+	size_t offset = *arena_size;
+	*arena_size += nr * item_size;
+	return offset;
+}
+
+struct config_arena
+config_alloc(struct config *config, const struct config_size *size)
+{
+	// Sections are ordered by alignment so that they need no padding
+	size_t arena_size = 0;
+	size_t keybinds = reserve(&arena_size, size->nr_keybinds,
+				  sizeof(struct keybind));
+	size_t gesturebinds = reserve(&arena_size, size->nr_gesturebinds,
+				      sizeof(struct gesturebind));
+	size_t modifiers = reserve(&arena_size, size->nr_modifiers,
+				   sizeof(struct modifier));
+	size_t sequences = reserve(&arena_size, size->nr_sequences,
+				   sizeof(struct sequence));
+	size_t sequence_states = reserve(&arena_size,
+					 1 + size->nr_sequence_keys,
+					 sizeof(struct sequence_state));
+	size_t keybind_index = reserve(&arena_size, size->nr_keybinds,
+				       sizeof(struct keybind *));
+	size_t modifier_keybind_index =
+		reserve(&arena_size, size->nr_modifier_keybinds,
+			sizeof(struct keybind *));
+	size_t action_events = reserve(&arena_size, 2 * size->nr_signals,
+				       sizeof(struct input_event));
+	size_t action_writes = reserve(&arena_size, size->nr_signals,
+				       sizeof(struct action_write));
+	size_t args = reserve(&arena_size, size->nr_args, sizeof(char *));
+	size_t modifier_keys = reserve(&arena_size, size->nr_modifier_keys,
+				       sizeof(struct modifier_key));
+	uint32_t sequence_table_size =
+		get_sequence_table_size(size->nr_sequence_keys);
+	size_t sequence_table = reserve(&arena_size, sequence_table_size,
+					sizeof(struct sequence_transition));
+	size_t sequence_keys = reserve(&arena_size, size->nr_sequence_keys,
+				       sizeof(uint32_t));
+	size_t signals = reserve(&arena_size, size->nr_signals,
+				 sizeof(struct key_signal));
+	size_t strings = reserve(&arena_size, size->strings_size, 1);
+
+	char *arena = calloc(1, arena_size ? arena_size : 1);
+	config->arena = arena;
+	config->arena_size = arena_size;
+	config->keybinds = (void *)(arena + keybinds);
+	config->nr_keybinds = size->nr_keybinds;
+	config->gesturebinds = (void *)(arena + gesturebinds);
+	config->nr_gesturebinds = size->nr_gesturebinds;
+	config->modifiers = (void *)(arena + modifiers);
+	config->nr_modifiers = size->nr_modifiers;
+	config->sequences = (void *)(arena + sequences);
+	config->nr_sequences = size->nr_sequences;
+	config->sequence_states = (void *)(arena + sequence_states);
+	config->sequence_table = (void *)(arena + sequence_table);
+	config->sequence_table_mask = sequence_table_size - 1;
+	config->keybind_index = (void *)(arena + keybind_index);
+	config->modifier_keybind_index =
+		(void *)(arena + modifier_keybind_index);
+	config->action_events = (void *)(arena + action_events);
+	config->action_writes = (void *)(arena + action_writes);
+
+	return (struct config_arena){
+		.modifier_keys = (void *)(arena + modifier_keys),
+		.sequence_keys = (void *)(arena + sequence_keys),
+		.signals = (void *)(arena + signals),
+		.args = (void *)(arena + args),
+		.strings = arena + strings,
+	};
+}
+
+static char *
+arena_strdup(struct config_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *result = memcpy(arena->strings, str, len);
+	arena->strings += len;
+	return result;
+}
+
+static void
+count_action(struct config_size *size, const struct parsed_action *action)
+{
+	switch (action->type) {
+	case ACTION_NONE:
+		break;
+	case ACTION_KEY:
+		size->nr_signals += tll_length(action->signals);
+		break;
+	case ACTION_COMMAND:
+		size->strings_size += strlen(action->cmd) + 1;
+		if (!action->argv)
+			break;
+		for (char **arg = action->argv; *arg; arg++) {
+			size->strings_size += strlen(*arg) + 1;
+			size->nr_args++;
+		}
+		size->nr_args++;
+		break;
+	}
+}
+
+static struct action
+pack_action(struct config_arena *arena, const struct parsed_action *src)
+{
+	struct action action = {.type = src->type};
+
+	switch (src->type) {
+	case ACTION_NONE:
+		break;
+	case ACTION_KEY:
+		action.signals = arena->signals;
+		action.nr_signals = tll_length(src->signals);
+		tll_foreach(src->signals, it)
+			*arena->signals++ = it->item;
+		break;
+	case ACTION_COMMAND:
+		action.cmd = arena_strdup(arena, src->cmd);
+		if (!src->argv)
+			break;
+		action.argv = arena->args;
+		for (char **arg = src->argv; *arg; arg++)
+			*arena->args++ = arena_strdup(arena, *arg);
+		*arena->args++ = NULL;
+		break;
+	}
+	return action;
+}
+
+// Lays out the parsed items in the arena of the config
+static void
+pack_config(struct parser_context *ctx)
+{
+	struct config *config = ctx->config;
+	struct config_size size = {
+		.nr_modifiers = tll_length(ctx->modifiers),
+		.nr_keybinds = tll_length(ctx->keybinds),
+		.nr_gesturebinds = tll_length(ctx->gesturebinds),
+		.nr_sequences = tll_length(ctx->sequences),
+	};
+	const char *rmlvo[] = {
+		ctx->keyboard.rules,   ctx->keyboard.model,
+		ctx->keyboard.layout,  ctx->keyboard.variant,
+		ctx->keyboard.options,
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(rmlvo); i++) {
+		if (rmlvo[i])
+			size.strings_size += strlen(rmlvo[i]) + 1;
+	}
+
+	tll_foreach(ctx->modifiers, it) {
+		size.nr_modifier_keys += tll_length(it->item.keys);
+		size.strings_size += strlen(it->item.name) + 1;
+	}
+	tll_foreach(ctx->keybinds, it) {
+		size.nr_modifier_keybinds +=
+			__builtin_popcountll(it->item.modifiers);
+		if (it->item.device)
+			size.strings_size += strlen(it->item.device) + 1;
+		count_action(&size, &it->item.on_press);
+		count_action(&size, &it->item.on_release);
+	}
+	tll_foreach(ctx->gesturebinds, it) {
+		count_action(&size, &it->item.on_forward);
+		count_action(&size, &it->item.on_backward);
+	}
+	tll_foreach(ctx->sequences, it) {
+		size.nr_sequence_keys += it->item.nr_keys;
+		count_action(&size, &it->item.on_match);
+	}
+
+	struct config_arena arena = config_alloc(config, &size);
 
-	tll_push_back(ctx->config->gesturebinds, bind);
+	for (int i = 0; i < ARRAY_SIZE(rmlvo); i++) {
+		if (rmlvo[i])
+			config->rmlvo[i] = arena_strdup(&arena, rmlvo[i]);
+	}
+	config->keymap_hash = hash_keymap(ctx->keymap);
+
+	struct modifier *modifier = config->modifiers;
+	tll_foreach(ctx->modifiers, it) {
+		modifier->name = arena_strdup(&arena, it->item.name);
+		modifier->keys = arena.modifier_keys;
+		modifier->nr_keys = tll_length(it->item.keys);
+		tll_foreach(it->item.keys, key_it)
+			*arena.modifier_keys++ = key_it->item;
+		modifier++;
+	}
+	struct keybind *keybind = config->keybinds;
+	tll_foreach(ctx->keybinds, it) {
+		keybind->keycode = it->item.keycode;
+		keybind->modifiers = it->item.modifiers;
+		if (it->item.device)
+			keybind->device = arena_strdup(&arena, it->item.device);
+		keybind->on_press = pack_action(&arena, &it->item.on_press);
+		keybind->on_release = pack_action(&arena, &it->item.on_release);
+		keybind++;
+	}
+	struct gesturebind *gesturebind = config->gesturebinds;
+	tll_foreach(ctx->gesturebinds, it) {
+		gesturebind->nr_fingers = it->item.nr_fingers;
+		gesturebind->direction = it->item.direction;
+		gesturebind->repeat = it->item.repeat;
+		gesturebind->on_forward =
+			pack_action(&arena, &it->item.on_forward);
+		gesturebind->on_backward =
+			pack_action(&arena, &it->item.on_backward);
+		gesturebind++;
+	}
+	struct sequence *sequence = config->sequences;
+	tll_foreach(ctx->sequences, it) {
+		sequence->keycodes = arena.sequence_keys;
+		sequence->nr_keys = it->item.nr_keys;
+		memcpy(arena.sequence_keys, it->item.keycodes,
+		       it->item.nr_keys * sizeof(uint32_t));
+		arena.sequence_keys += it->item.nr_keys;
+		sequence->timeout = it->item.timeout;
+		sequence->on_match = pack_action(&arena, &it->item.on_match);
+		sequence++;
+	}
 }
 
 static void
-print_action(struct parser_context *ctx, struct action *action)
+print_action(struct parser_context *ctx, const struct action *action)
 {
 	switch (action->type) {
 	case ACTION_NONE:
 		break;
 	case ACTION_COMMAND:
-		printf("%s\n", action->cmd);
+		printf("%s%s\n", action->cmd, action->argv ? "" : " (shell)");
 		break;
 	case ACTION_KEY:
 		printf("[ ");
-		tll_foreach(action->signals, it)
-			printf("%s%s ", it->item.press ? "+" : "-",
-			       keycode_to_keyname(ctx, it->item.keycode));
+		for (uint32_t i = 0; i < action->nr_signals; i++)
+			printf("%s%s ", action->signals[i].press ? "+" : "-",
+			       keycode_to_keyname(ctx,
+						  action->signals[i].keycode));
 		printf("]\n");
 		break;
 	}
@@ -542,106 +1557,122 @@ print_config(struct parser_context *ctx)
 	struct config *config = ctx->config;
 
 	printf("modifiers:\n");
-	tll_foreach(config->modifiers, mod_it) {
-		printf("  %s:\n", mod_it->item.name);
-		tll_foreach(mod_it->item.keys, key_it) {
-			uint32_t keycode = key_it->item.keycode;
-			uint32_t send_keycode = key_it->item.send_keycode;
+	for (uint32_t i = 0; i < config->nr_modifiers; i++) {
+		const struct modifier *modifier = &config->modifiers[i];
+		printf("  %s:\n", modifier->name);
+		for (uint32_t j = 0; j < modifier->nr_keys; j++) {
+			uint32_t keycode = modifier->keys[j].keycode;
+			uint32_t send_keycode = modifier->keys[j].send_keycode;
 			printf("    - key: %s\n",
 			       keycode_to_keyname(ctx, keycode));
 			printf("      send_key: %s\n",
 			       send_keycode
 				       ? keycode_to_keyname(ctx, send_keycode)
 				       : "false");
+			uint32_t tap_keycode = modifier->keys[j].tap_keycode;
+			if (tap_keycode) {
+				printf("      tap: %s\n",
+				       keycode_to_keyname(ctx, tap_keycode));
+			}
 		}
 	}
 
 	printf("keybinds:\n");
-	tll_foreach(config->keybinds, bind_it) {
-		printf("  - key: %s\n",
-		       keycode_to_keyname(ctx, bind_it->item.keycode));
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		const struct keybind *bind = &config->keybinds[i];
+		printf("  - key: %s\n", keycode_to_keyname(ctx, bind->keycode));
 		printf("    modifiers: [ ");
-		tll_foreach(bind_it->item.modifiers, mod_it)
-			printf("%s ", mod_it->item->name);
+		for (uint32_t j = 0; j < config->nr_modifiers; j++) {
+			if (bind->modifiers & ((modmask_t)1 << j))
+				printf("%s ", config->modifiers[j].name);
+		}
 		printf("]\n");
+		if (bind->device)
+			printf("    device: %s\n", bind->device);
 		printf("    on_press: ");
-		print_action(ctx, &bind_it->item.on_press);
+		print_action(ctx, &bind->on_press);
 		printf("    on_release: ");
-		print_action(ctx, &bind_it->item.on_release);
+		print_action(ctx, &bind->on_release);
 	}
 
 	printf("gesturebinds:\n");
-	tll_foreach(config->gesturebinds, bind_it) {
+	for (uint32_t i = 0; i < config->nr_gesturebinds; i++) {
+		const struct gesturebind *bind = &config->gesturebinds[i];
 		printf("  - gesture: %s\n", "swipe"); // currently fixed
-		printf("    fingers: %d\n", bind_it->item.nr_fingers);
+		printf("    fingers: %d\n", bind->nr_fingers);
 		printf("    direction: %s\n",
-		       bind_it->item.direction == DIRECTION_UP	    ? "up"
-		       : bind_it->item.direction == DIRECTION_DOWN  ? "down"
-		       : bind_it->item.direction == DIRECTION_LEFT  ? "left"
-		       : bind_it->item.direction == DIRECTION_RIGHT ? "right"
-								    : "?");
-		printf("    repeat: %s\n",
-		       bind_it->item.repeat ? "true" : "false");
+		       bind->direction == DIRECTION_UP	    ? "up"
+		       : bind->direction == DIRECTION_DOWN  ? "down"
+		       : bind->direction == DIRECTION_LEFT  ? "left"
+		       : bind->direction == DIRECTION_RIGHT ? "right"
+							    : "?");
+		printf("    repeat: %s\n", bind->repeat ? "true" : "false");
 		printf("    on_forward: ");
-		print_action(ctx, &bind_it->item.on_forward);
+		print_action(ctx, &bind->on_forward);
 		printf("    on_backward: ");
-		print_action(ctx, &bind_it->item.on_backward);
+		print_action(ctx, &bind->on_backward);
+	}
+
+	printf("sequences:\n");
+	for (uint32_t i = 0; i < config->nr_sequences; i++) {
+		const struct sequence *sequence = &config->sequences[i];
+		printf("  - keys: [ ");
+		for (uint32_t j = 0; j < sequence->nr_keys; j++) {
+			printf("%s ", keycode_to_keyname(
+					      ctx, sequence->keycodes[j]));
+		}
+		printf("]\n");
+		printf("    timeout: %g\n", sequence->timeout);
+		printf("    on_match: ");
+		print_action(ctx, &sequence->on_match);
 	}
 }
 
-void
-config_init(struct server *server)
+static bool
+parse_document(struct parser_context *ctx)
 {
-	struct config *config = &server->config;
-
-	config->swipe_thr = 50.;
-	config->key_interval = 0.;
-	config->key_repeat_delay = 0.5;
-	config->key_repeat_interval = 0.03333;
-
-	FILE *fp;
-	fp = fopen("config.yml", "r");
-	if (!fp)
-		fp = fopen("/etc/rydeen/config.yml", "r");
-	if (!fp) {
-		fprintf(stderr, "config file not present\n");
-		exit(1);
+	if (!yaml_parser_load(&ctx->parser, &ctx->doc)) {
+		fprintf(stderr, "Failed to parse config at %zu:%zu: %s\n",
+			ctx->parser.problem_mark.line + 1,
+			ctx->parser.problem_mark.column + 1,
+			ctx->parser.problem);
+		return false;
 	}
 
-	struct parser_context ctx = {.config = config};
-	yaml_parser_initialize(&ctx.parser);
-	yaml_parser_set_input_file(&ctx.parser, fp);
-	yaml_parser_load(&ctx.parser, &ctx.doc);
-
-	yaml_node_t *root_node = yaml_document_get_root_node(&ctx.doc);
-	if (!root_node)
-		PANIC(root_node);
+	yaml_node_t *root_node = yaml_document_get_root_node(&ctx->doc);
+	if (!root_node) {
+		fprintf(stderr, "Config file is empty\n");
+		return false;
+	}
 
 	// "general"
-	yaml_node_t *general_node = get_node_by_key(&ctx, root_node, "general");
-	if (general_node)
-		parse_general(&ctx, general_node);
+	yaml_node_t *general_node = get_node_by_key(ctx, root_node, "general");
+	if (general_node && !parse_general(ctx, general_node))
+		return false;
 
-	ctx.xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	ctx.keymap = xkb_keymap_new_from_names(ctx.xkb_ctx, &ctx.keyboard,
-					       XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!load_keymap(ctx)) {
+		fprintf(stderr, "Could not compile keymap\n");
+		return false;
+	}
 
 	// "modifiers"
 	yaml_node_t *modifiers_node =
-		get_node_by_key(&ctx, root_node, "modifiers");
+		get_node_by_key(ctx, root_node, "modifiers");
 	if (modifiers_node) {
 		if (modifiers_node->type != YAML_MAPPING_NODE)
 			PANIC(modifiers_node);
 		for (yaml_node_pair_t *modifier_kv =
 			     modifiers_node->data.mapping.pairs.start;
 		     modifier_kv < modifiers_node->data.mapping.pairs.top;
-		     modifier_kv++)
-			parse_modifier(&ctx, modifier_kv);
+		     modifier_kv++) {
+			if (!parse_modifier(ctx, modifier_kv))
+				return false;
+		}
 	}
 
 	// "keybinds"
 	yaml_node_t *keybinds_node =
-		get_node_by_key(&ctx, root_node, "keybinds");
+		get_node_by_key(ctx, root_node, "keybinds");
 	if (keybinds_node) {
 		if (keybinds_node->type != YAML_SEQUENCE_NODE)
 			PANIC(keybinds_node);
@@ -649,15 +1680,16 @@ config_init(struct server *server)
 			     keybinds_node->data.sequence.items.start;
 		     keybind_node_id < keybinds_node->data.sequence.items.top;
 		     keybind_node_id++) {
-			parse_keybind(&ctx,
-				      yaml_document_get_node(&ctx.doc,
-							     *keybind_node_id));
+			yaml_node_t *keybind_node = yaml_document_get_node(
+				&ctx->doc, *keybind_node_id);
+			if (!parse_keybind(ctx, keybind_node))
+				return false;
 		}
 	}
 
 	// "gesturebinds"
 	yaml_node_t *gesturebinds_node =
-		get_node_by_key(&ctx, root_node, "gesturebinds");
+		get_node_by_key(ctx, root_node, "gesturebinds");
 	if (gesturebinds_node) {
 		if (gesturebinds_node->type != YAML_SEQUENCE_NODE)
 			PANIC(gesturebinds_node);
@@ -665,58 +1697,241 @@ config_init(struct server *server)
 			     gesturebinds_node->data.sequence.items.start;
 		     bind_node_id < gesturebinds_node->data.sequence.items.top;
 		     bind_node_id++) {
-			parse_gesturebind(
-				&ctx, yaml_document_get_node(&ctx.doc,
-							     *bind_node_id));
+			yaml_node_t *bind_node = yaml_document_get_node(
+				&ctx->doc, *bind_node_id);
+			if (!parse_gesturebind(ctx, bind_node))
+				return false;
 		}
 	}
 
+	// "sequences"
+	yaml_node_t *sequences_node =
+		get_node_by_key(ctx, root_node, "sequences");
+	if (sequences_node) {
+		if (sequences_node->type != YAML_SEQUENCE_NODE)
+			PANIC(sequences_node);
+		for (yaml_node_item_t *sequence_node_id =
+			     sequences_node->data.sequence.items.start;
+		     sequence_node_id < sequences_node->data.sequence.items.top;
+		     sequence_node_id++) {
+			yaml_node_t *sequence_node = yaml_document_get_node(
+				&ctx->doc, *sequence_node_id);
+			if (!parse_sequence(ctx, sequence_node))
+				return false;
+		}
+	}
+
+	pack_config(ctx);
 	if (DEBUG)
-		print_config(&ctx);
+		print_config(ctx);
+	return true;
+}
+
+static void
+free_parsed_action(struct parsed_action *action)
+{
+	tll_free(action->signals);
+	if (action->argv) {
+		for (char **arg = action->argv; *arg; arg++)
+			free(*arg);
+		free(action->argv);
+	}
+}
+
+static bool
+parse_config(struct config *config, const char *yaml, size_t yaml_len)
+{
+	struct parser_context *ctx = znew(*ctx);
+	ctx->config = config;
+	yaml_parser_initialize(&ctx->parser);
+	yaml_parser_set_input_string(&ctx->parser, (const unsigned char *)yaml,
+				     yaml_len);
+
+	bool parsed = parse_document(ctx);
+
+	yaml_parser_delete(&ctx->parser);
+	yaml_document_delete(&ctx->doc);
+	free_keymap(ctx);
+	tll_foreach(ctx->modifiers, it)
+		tll_free(it->item.keys);
+	tll_free(ctx->modifiers);
+	tll_foreach(ctx->keybinds, it) {
+		free_parsed_action(&it->item.on_press);
+		free_parsed_action(&it->item.on_release);
+	}
+	tll_free(ctx->keybinds);
+	tll_foreach(ctx->gesturebinds, it) {
+		free_parsed_action(&it->item.on_forward);
+		free_parsed_action(&it->item.on_backward);
+	}
+	tll_free(ctx->gesturebinds);
+	tll_foreach(ctx->sequences, it)
+		free_parsed_action(&it->item.on_match);
+	tll_free(ctx->sequences);
+	free(ctx);
+
+	return parsed;
+}
+
+static uint64_t
+hash_config(const char *yaml, size_t yaml_len)
+{
+	// FNV-1a over the document and the RMLVO defaults which xkbcommon
+	// takes from the environment when they are not configured
+	static const char *env_names[] = {
+		"XKB_DEFAULT_RULES",   "XKB_DEFAULT_MODEL",
+		"XKB_DEFAULT_LAYOUT",  "XKB_DEFAULT_VARIANT",
+		"XKB_DEFAULT_OPTIONS",
+	};
+	uint64_t hash = fnv1a(14695981039346656037u, yaml, yaml_len);
+	for (int i = 0; i < ARRAY_SIZE(env_names); i++) {
+		const char *value = getenv(env_names[i]);
+		if (!value)
+			value = "";
+		// including the terminating NUL
+		hash = fnv1a(hash, value, strlen(value) + 1);
+	}
+	return hash;
+}
 
-	yaml_parser_delete(&ctx.parser);
-	yaml_document_delete(&ctx.doc);
-	xkb_keymap_unref(ctx.keymap);
-	xkb_context_unref(ctx.xkb_ctx);
+const char *
+config_find_path(void)
+{
+	static const char *paths[] = {"config.yml", "/etc/rydeen/config.yml"};
+	for (int i = 0; i < ARRAY_SIZE(paths); i++)
+		if (!access(paths[i], R_OK))
+			return paths[i];
+	return NULL;
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	char *data = NULL;
+	FILE *stream = open_memstream(&data, len);
+	char buf[4096];
+	size_t buf_len;
+	while ((buf_len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, buf_len, stream);
+	fclose(stream);
 	fclose(fp);
+	return data;
 }
 
 static void
-free_action(struct action *action)
+set_defaults(struct config *config)
 {
-	switch (action->type) {
-	case ACTION_NONE:
-		break;
-	case ACTION_KEY:
-		tll_free(action->signals);
-		break;
-	case ACTION_COMMAND:
-		free((char *)action->cmd);
-		break;
-	}
+	config->swipe_thr = 50.;
+	config->swipe_velocity = 0.;
+	config->swipe_min_distance = 10.;
+	config->swipe_angle = 20.;
+	config->key_interval = 0.;
+	config->key_action_policy = KEY_ACTION_SERIALIZE;
+	config->key_action_queue_size = 64;
+	config->key_repeat_delay = 0.5;
+	config->key_repeat_interval = 0.03333;
+	config->tap_timeout = 0.2;
 }
 
-void
-config_finish(struct server *server)
+// Saves the cache when it's stale if cache_saved is not NULL, which is
+// only the case on startup and for --compile
+static bool
+load_config(struct config *config, bool use_cache, bool *cache_saved)
 {
-	struct config *config = &server->config;
+	set_defaults(config);
 
-	tll_foreach(config->modifiers, it) {
-		tll_free(it->item.keys);
-		free((char *)it->item.name);
+	const char *path = config_find_path();
+	if (!path) {
+		fprintf(stderr, "config file not present\n");
+		return false;
 	}
-	tll_free(config->modifiers);
-	tll_foreach(config->keybinds, it) {
-		tll_free(it->item.modifiers);
-		free_action(&it->item.on_press);
-		free_action(&it->item.on_release);
+
+	size_t yaml_len;
+	char *yaml = read_file(path, &yaml_len);
+	if (!yaml) {
+		perror(path);
+		return false;
+	}
+
+	uint64_t hash = hash_config(yaml, yaml_len);
+	bool cached = use_cache && config_cache_load(config, hash);
+	if (cached && !is_keymap_current(config)) {
+		debug("Keymap changed since %s was saved\n",
+		      RYDEEN_CACHE_PATH);
+		config_free(config);
+		set_defaults(config);
+		cached = false;
+	}
+	if (cached) {
+		debug("Loaded config from %s\n", RYDEEN_CACHE_PATH);
+	} else if (parse_config(config, yaml, yaml_len)) {
+		if (cache_saved)
+			*cache_saved = config_cache_save(config, hash);
+	} else {
+		free(yaml);
+		config_free(config);
+		return false;
+	}
+	free(yaml);
+
+	resolve_config(config);
+	return true;
+}
+
+bool
+config_load(struct config *config, bool use_cache)
+{
+	return load_config(config, use_cache, NULL);
+}
+
+bool
+config_parse(struct config *config, const char *yaml, size_t yaml_len)
+{
+	set_defaults(config);
+	if (!parse_config(config, yaml, yaml_len)) {
+		config_free(config);
+		return false;
 	}
-	tll_free(config->keybinds);
-	tll_foreach(config->gesturebinds, it) {
-		free_action(&it->item.on_forward);
-		free_action(&it->item.on_backward);
+	resolve_config(config);
+	return true;
+}
+
+void
+config_init(struct server *server)
+{
+	bool cache_saved = false;
+	if (!load_config(&server->config, true, &cache_saved))
+		exit(1);
+	if (cache_saved)
+		debug("Saved config to %s\n", RYDEEN_CACHE_PATH);
+}
+
+bool
+config_compile(struct server *server)
+{
+	bool cache_saved = false;
+	if (!load_config(&server->config, false, &cache_saved))
+		return false;
+	if (!cache_saved) {
+		fprintf(stderr, "Could not write %s\n", RYDEEN_CACHE_PATH);
+		return false;
 	}
-	tll_free(config->gesturebinds);
+	return true;
+}
 
+void
+config_free(struct config *config)
+{
+	free(config->arena);
 	*config = (struct config){0};
 }
+
+void
+config_finish(struct server *server)
+{
+	config_free(&server->config);
+}
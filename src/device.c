@@ -0,0 +1,207 @@
+#include "rydeen.h"
+#include <libudev.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Classifies devices from the properties udev already set on them, so
+// that ignored devices are never opened. Results are kept by syspath,
+// which contains the number of the input device the kernel never reuses.
+// The oldest ones are dropped past this so replugging doesn't grow it.
+#define DEVICE_CLASS_CACHE_SIZE 256
+
+static bool
+has_property(struct udev_device *device, const char *key)
+{
+	const char *value = udev_device_get_property_value(device, key);
+	return value && !strcmp(value, "1");
+}
+
+static bool
+is_rydeen_udev_device(struct udev_device *device)
+{
+	// The ids are attributes of the input device above the event node
+	struct udev_device *input = udev_device_get_parent(device);
+	if (!input)
+		return false;
+	const char *vendor = udev_device_get_sysattr_value(input, "id/vendor");
+	const char *product =
+		udev_device_get_sysattr_value(input, "id/product");
+	if (!vendor || !product)
+		return false;
+	return is_rydeen_id(strtol(vendor, NULL, 16),
+			    strtol(product, NULL, 16));
+}
+
+// Follows get_device_type in rydeen.c
+static enum device_type
+classify(struct udev_device *device)
+{
+	// Not processed by udev, e.g. in a container
+	if (!has_property(device, "ID_INPUT"))
+		return DEVICE_UNKNOWN;
+	if (has_property(device, "ID_INPUT_MOUSE")
+	    || has_property(device, "ID_INPUT_POINTINGSTICK")
+	    || has_property(device, "ID_INPUT_TRACKBALL"))
+		return DEVICE_MOUSE;
+	if (has_property(device, "ID_INPUT_TOUCHPAD"))
+		return DEVICE_TOUCHPAD;
+	if (has_property(device, "ID_INPUT_KEYBOARD")) {
+		if (is_rydeen_udev_device(device))
+			return DEVICE_RYDEEN;
+		return DEVICE_KEYBOARD;
+	}
+	// ID_INPUT_KEY is set for media keys we want and for power buttons
+	// we must not grab, and touchscreens are passed to libinput
+	if (has_property(device, "ID_INPUT_KEY")
+	    || has_property(device, "ID_INPUT_TOUCHSCREEN"))
+		return DEVICE_UNKNOWN;
+	return DEVICE_NONE;
+}
+
+enum device_type
+device_classify(struct server *server, const char *path)
+{
+	struct stat st;
+	if (!server->udev || stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+		return DEVICE_UNKNOWN;
+	struct udev_device *device =
+		udev_device_new_from_devnum(server->udev, 'c', st.st_rdev);
+	if (!device)
+		return DEVICE_UNKNOWN;
+
+	enum device_type type;
+	const char *syspath = udev_device_get_syspath(device);
+	tll_foreach(server->device_classes, it) {
+		if (!strcmp(it->item.syspath, syspath)) {
+			type = it->item.type;
+			goto out;
+		}
+	}
+
+	type = classify(device);
+	if (type != DEVICE_UNKNOWN) {
+		if (tll_length(server->device_classes)
+		    == DEVICE_CLASS_CACHE_SIZE) {
+			struct device_class oldest =
+				tll_pop_front(server->device_classes);
+			free(oldest.syspath);
+		}
+		struct device_class class = {
+			.syspath = strdup(syspath),
+			.type = type,
+		};
+		tll_push_back(server->device_classes, class);
+	}
+out:
+	udev_device_unref(device);
+	return type;
+}
+
+bool
+input_device_matches(const struct input_device *device, const char *scope)
+{
+	return !strcmp(scope, device->name) || !strcmp(scope, device->id);
+}
+
+// Gives the device its own keybinds if some of them are limited to it
+static void
+build_keybind_index(const struct config *config, struct input_device *device)
+{
+	free(device->keybind_index);
+	free(device->keybind_offsets);
+	device->keybind_index = NULL;
+	device->keybind_offsets = NULL;
+
+	bool scoped = false;
+	for (uint32_t i = 0; i < config->nr_keybinds && !scoped; i++) {
+		const char *scope = config->keybinds[i].device;
+		scoped = scope && input_device_matches(device, scope);
+	}
+	if (!scoped)
+		return;
+
+	device->keybind_index =
+		calloc(config->nr_keybinds, sizeof(*device->keybind_index));
+	device->keybind_offsets =
+		calloc(MAX_KEYCODE + 1, sizeof(*device->keybind_offsets));
+	config_build_keybind_index(config, device, device->keybind_index,
+				   device->keybind_offsets);
+}
+
+struct input_device *
+input_device_create(struct server *server, const char *name, int vendor_id,
+		    int product_id)
+{
+	struct input_device *device = znew(*device);
+	device->name = strdup(name);
+	snprintf(device->id, sizeof(device->id), "%04x:%04x",
+		 vendor_id & 0xffff, product_id & 0xffff);
+	build_keybind_index(&server->config, device);
+	tll_push_back(server->devices, device);
+	return device;
+}
+
+void
+input_device_destroy(struct server *server, struct input_device *device)
+{
+	// Held back keys may be from the device
+	tap_hold_flush(server);
+	sequence_flush(server);
+	// Keys still pressed are released so that they neither stay pressed
+	// on the output nor keep holding keybinds
+	for (int i = 0; i < ARRAY_SIZE(device->pressed_keys.words); i++) {
+		uint64_t word = device->pressed_keys.words[i];
+		while (word) {
+			uint32_t keycode = i * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+			process_key_event(server, device, keycode, false);
+		}
+	}
+	tll_foreach(server->devices, it) {
+		if (it->item == device)
+			tll_remove(server->devices, it);
+	}
+	free(device->keybind_index);
+	free(device->keybind_offsets);
+	free(device->name);
+	free(device);
+}
+
+// The keybinds were released with the previous config, and the keys which
+// ran them are forgotten so that their releases are swallowed. Passing the
+// releases through would release keys never pressed on the output.
+static void
+forget_bound_keys(struct input_device *device)
+{
+	for (int i = 0; i < ARRAY_SIZE(device->pressed_keys.words); i++)
+		device->pressed_keys.words[i] &= ~device->bound_keys.words[i];
+	device->bound_keys = (struct ryd_keyset){0};
+	memset(device->keybinds, 0, sizeof(device->keybinds));
+}
+
+void
+input_device_reload(struct server *server)
+{
+	tll_foreach(server->devices, it) {
+		forget_bound_keys(it->item);
+		build_keybind_index(&server->config, it->item);
+	}
+	forget_bound_keys(&server->unknown_device);
+}
+
+void
+device_finish(struct server *server)
+{
+	// libinput doesn't report its devices as removed when it's destroyed
+	while (tll_length(server->devices))
+		input_device_destroy(server, tll_front(server->devices));
+	tll_foreach(server->device_classes, it) {
+		free(it->item.syspath);
+		tll_remove(server->device_classes, it);
+	}
+	if (server->udev)
+		udev_unref(server->udev);
+	server->udev = NULL;
+}
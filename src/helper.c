@@ -0,0 +1,207 @@
+#include "rydeen.h"
+#include <errno.h>
+#include <ev.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <wait.h>
+
+// Commands are sent to the helper process in a single packet:
+// 'a' followed by NUL-terminated argv, or 's' followed by NUL-terminated
+// shell command. The helper reports the wait status of each exited child.
+#define HELPER_MSG_SIZE 4096
+
+struct helper_report {
+	pid_t pid;
+	int status;
+};
+
+static void
+helper_reap_children(int fd)
+{
+	struct helper_report report;
+	while ((report.pid = waitpid(-1, &report.status, WNOHANG)) > 0)
+		send(fd, &report, sizeof(report), MSG_NOSIGNAL);
+}
+
+static void
+helper_spawn(char *msg, size_t len)
+{
+	if (len < 2 || msg[len - 1] != '\0')
+		return;
+
+	if (msg[0] == 's') {
+		spawn_command(&msg[1], NULL);
+		return;
+	}
+
+	char *argv[HELPER_MSG_SIZE / 2 + 1];
+	int argc = 0;
+	for (char *p = &msg[1]; p < &msg[len]; p += strlen(p) + 1)
+		argv[argc++] = p;
+	argv[argc] = NULL;
+	spawn_command(argv[0], argv);
+}
+
+static _Noreturn void
+helper_main(int fd, pid_t parent_pid)
+{
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	// The daemon may have exited before the signal was set up
+	if (getppid() != parent_pid)
+		_exit(0);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+	struct pollfd fds[] = {
+		{.fd = fd, .events = POLLIN},
+		{.fd = sfd, .events = POLLIN},
+	};
+	char msg[HELPER_MSG_SIZE];
+
+	for (;;) {
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			if (read(sfd, &info, sizeof(info)) < 0)
+				break;
+			helper_reap_children(fd);
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t len = recv(fd, msg, sizeof(msg), 0);
+			if (len <= 0)
+				break;
+			helper_spawn(msg, len);
+		}
+	}
+
+	_exit(0);
+}
+
+static void
+stop_helper(struct server *server)
+{
+	struct spawn_helper *helper = &server->spawn_helper;
+
+	ev_io_stop(server->loop, &helper->watcher);
+	close(helper->fd);
+	helper->fd = -1;
+}
+
+static void
+handle_helper_report(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct server *server = w->data;
+	struct spawn_helper *helper = &server->spawn_helper;
+
+	struct helper_report report;
+	ssize_t len = recv(helper->fd, &report, sizeof(report), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len != sizeof(report)) {
+		fprintf(stderr, "Spawn helper exited, running commands "
+				"directly\n");
+		stop_helper(server);
+		return;
+	}
+
+	if (!WIFEXITED(report.status))
+		fprintf(stderr, "The child process has not been terminated\n");
+}
+
+void
+spawn_helper_init(struct server *server)
+{
+	struct spawn_helper *helper = &server->spawn_helper;
+	helper->fd = -1;
+
+	// The action thread already keeps spawning off the input path
+	if (!server->config.spawn_helper || server->config.action_thread)
+		return;
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		perror("Could not create socket for spawn helper");
+		return;
+	}
+
+	pid_t parent_pid = getpid();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Could not fork spawn helper");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	} else if (pid == 0) {
+		close(fds[0]);
+		config_finish(server);
+		helper_main(fds[1], parent_pid);
+	}
+
+	close(fds[1]);
+	helper->pid = pid;
+	helper->fd = fds[0];
+	helper->watcher.data = server;
+	ev_io_init(&helper->watcher, handle_helper_report, helper->fd,
+		   EV_READ);
+	ev_io_start(server->loop, &helper->watcher);
+}
+
+void
+spawn_helper_finish(struct server *server)
+{
+	struct spawn_helper *helper = &server->spawn_helper;
+
+	if (helper->fd < 0)
+		return;
+	stop_helper(server);
+	waitpid(helper->pid, NULL, 0);
+}
+
+bool
+spawn_helper_run(struct server *server, const struct action *action)
+{
+	struct spawn_helper *helper = &server->spawn_helper;
+
+	if (helper->fd < 0)
+		return false;
+
+	char msg[HELPER_MSG_SIZE];
+	size_t len = 0;
+	if (action->argv) {
+		msg[len++] = 'a';
+		for (char **arg = action->argv; *arg; arg++) {
+			size_t arg_len = strlen(*arg) + 1;
+			if (len + arg_len > sizeof(msg))
+				return false;
+			memcpy(&msg[len], *arg, arg_len);
+			len += arg_len;
+		}
+	} else {
+		size_t cmd_len = strlen(action->cmd) + 1;
+		if (1 + cmd_len > sizeof(msg))
+			return false;
+		msg[len++] = 's';
+		memcpy(&msg[len], action->cmd, cmd_len);
+		len += cmd_len;
+	}
+
+	// Fall back to spawning directly rather than blocking the event loop
+	// when the helper is busy
+	return send(helper->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+	       == (ssize_t)len;
+}
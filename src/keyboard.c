@@ -0,0 +1,134 @@
+#include "rydeen.h"
+#include <errno.h>
+#include <ev.h>
+#include <libevdev/libevdev.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Keyboards are read directly instead of through libinput, which only
+// adds allocations and a dispatch per event for them. libinput still
+// finds the devices and we take them over in open_restricted.
+
+static void
+handle_key(struct keyboard *keyboard, const struct input_event *event)
+{
+	struct server *server = keyboard->server;
+	uint32_t keycode = event->code;
+	bool pressed = event->value;
+
+	if (pressed)
+		ryd_keyset_add(&keyboard->pressed_keys, keycode);
+	else
+		ryd_keyset_remove(&keyboard->pressed_keys, keycode);
+
+	struct ryd_event ryd_event = {
+		.type = RYD_EVENT_KEY,
+		.time_usec = event->input_event_sec * 1000000ull
+			     + event->input_event_usec,
+		.keycode = keycode,
+		.pressed = pressed,
+	};
+	handle_input_event(server, keyboard->device, &ryd_event);
+}
+
+// Releases the keys held by a keyboard which is going away
+static void
+release_keys(struct keyboard *keyboard)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	struct input_event event = {
+		.input_event_sec = ts.tv_sec,
+		.input_event_usec = ts.tv_nsec / 1000,
+		.type = EV_KEY,
+		.value = 0,
+	};
+	for (uint32_t keycode = 0; keycode < MAX_KEYCODE; keycode++) {
+		if (ryd_keyset_contains(&keyboard->pressed_keys, keycode)) {
+			event.code = keycode;
+			handle_key(keyboard, &event);
+		}
+	}
+}
+
+static void
+keyboard_destroy(struct keyboard *keyboard)
+{
+	struct server *server = keyboard->server;
+	int fd = libevdev_get_fd(keyboard->evdev);
+
+	ev_io_stop(server->loop, &keyboard->watcher);
+	tll_foreach(server->keyboards, it) {
+		if (it->item == keyboard)
+			tll_remove(server->keyboards, it);
+	}
+	input_device_destroy(server, keyboard->device);
+	libevdev_free(keyboard->evdev);
+	close(fd);
+	free(keyboard);
+}
+
+static void
+handle_keyboard_readable(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct keyboard *keyboard = w->data;
+	struct server *server = keyboard->server;
+
+	struct input_event event;
+	unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+	int ret;
+	while ((ret = libevdev_next_event(keyboard->evdev, flags, &event))
+	       >= 0) {
+		if (ret == LIBEVDEV_READ_STATUS_SYNC) {
+			// Events were dropped by the kernel. libevdev
+			// replays the changed keys until it's in sync.
+			flags = LIBEVDEV_READ_FLAG_SYNC;
+		}
+		// Repeats (value 2) are generated by uinput instead
+		if (event.type == EV_KEY && event.value != 2)
+			handle_key(keyboard, &event);
+	}
+	if (ret == -EAGAIN && flags == LIBEVDEV_READ_FLAG_SYNC) {
+		// Sync is done, normal events may be pending
+		ev_feed_event(loop, w, EV_READ);
+	} else if (ret != -EAGAIN) {
+		debug("Keyboard removed: %s\n",
+		      libevdev_get_name(keyboard->evdev));
+		release_keys(keyboard);
+		keyboard_destroy(keyboard);
+	}
+
+	latency_end_event(server);
+	uinput_flush(server);
+}
+
+void
+keyboard_add(struct server *server, int fd, struct libevdev *evdev)
+{
+	// Same clock as the timestamps of libinput
+	if (libevdev_set_clock_id(evdev, CLOCK_MONOTONIC) < 0) {
+		fprintf(stderr, "Could not set clock of %s\n",
+			libevdev_get_name(evdev));
+	}
+
+	struct keyboard *keyboard = znew(*keyboard);
+	keyboard->server = server;
+	keyboard->device = input_device_create(
+		server, libevdev_get_name(evdev), libevdev_get_id_vendor(evdev),
+		libevdev_get_id_product(evdev));
+	keyboard->evdev = evdev;
+	keyboard->watcher.data = keyboard;
+	ev_io_init(&keyboard->watcher, handle_keyboard_readable, fd, EV_READ);
+	ev_io_start(server->loop, &keyboard->watcher);
+	tll_push_back(server->keyboards, keyboard);
+}
+
+void
+keyboard_finish(struct server *server)
+{
+	while (tll_length(server->keyboards))
+		keyboard_destroy(tll_front(server->keyboards));
+}
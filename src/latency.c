@@ -0,0 +1,241 @@
+#include "rydeen.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Log-linear histogram like HdrHistogram: values below SUB_BUCKETS have
+// their own buckets, and each power of two above is split into
+// SUB_BUCKETS buckets, which keeps the error of percentiles within 1/16.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+// Latencies are recorded in microseconds up to 2^40 (about 12 days)
+#define MAX_EXPONENT 39
+#define MAX_VALUE (((uint64_t)1 << (MAX_EXPONENT + 1)) - 1)
+#define NR_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+// Events handled before the output is written
+#define MAX_PENDING_SAMPLES 64
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[NR_BUCKETS];
+};
+
+struct latency_sample {
+	uint64_t event_time;
+	enum latency_path path;
+};
+
+struct latency_stats {
+	struct histogram histograms[LATENCY_NR_PATHS];
+	// Kernel timestamp of the event being handled, or 0
+	uint64_t event_time;
+	bool gesture;
+	bool deferred;
+	struct latency_sample pending[MAX_PENDING_SAMPLES];
+	int nr_pending;
+	uint64_t nr_skipped;
+};
+
+static const char *path_names[LATENCY_NR_PATHS] = {
+	[LATENCY_PASSTHROUGH] = "passthrough",
+	[LATENCY_KEY_ACTION] = "key action",
+	[LATENCY_COMMAND] = "command spawn",
+	[LATENCY_GESTURE] = "gesture",
+	[LATENCY_TAP_HOLD] = "tap-hold",
+};
+
+static int
+get_bucket(uint64_t value)
+{
+	if (value < SUB_BUCKETS)
+		return value;
+	if (value > MAX_VALUE)
+		value = MAX_VALUE;
+	int exponent = 63 - __builtin_clzll(value);
+	int group = exponent - SUB_BUCKET_BITS + 1;
+	int sub_bucket = (value >> (exponent - SUB_BUCKET_BITS))
+			 & (SUB_BUCKETS - 1);
+	return group * SUB_BUCKETS + sub_bucket;
+}
+
+// Returns the largest value in the bucket
+static uint64_t
+get_bucket_value(int bucket)
+{
+	int group = bucket / SUB_BUCKETS;
+	int sub_bucket = bucket % SUB_BUCKETS;
+	if (group == 0)
+		return sub_bucket;
+	int exponent = group + SUB_BUCKET_BITS - 1;
+	return ((uint64_t)(SUB_BUCKETS + sub_bucket + 1)
+		<< (exponent - SUB_BUCKET_BITS))
+	       - 1;
+}
+
+static void
+histogram_record(struct histogram *histogram, uint64_t value)
+{
+	histogram->buckets[get_bucket(value)]++;
+	histogram->count++;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+static uint64_t
+histogram_percentile(const struct histogram *histogram, double percentile)
+{
+	double exact_target = histogram->count * percentile / 100.;
+	uint64_t target = exact_target;
+	if (target < exact_target || target == 0)
+		target++;
+	uint64_t count = 0;
+	for (int i = 0; i < NR_BUCKETS; i++) {
+		count += histogram->buckets[i];
+		if (count >= target) {
+			uint64_t value = get_bucket_value(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+static uint64_t
+get_time_usec(void)
+{
+	// libinput timestamps are in CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void
+record(struct latency_stats *stats, enum latency_path path,
+       uint64_t event_time, uint64_t now)
+{
+	uint64_t latency = now > event_time ? now - event_time : 0;
+	histogram_record(&stats->histograms[path], latency);
+}
+
+void
+latency_init(struct server *server)
+{
+	server->latency = znew(*server->latency);
+}
+
+void
+latency_finish(struct server *server)
+{
+	if (!server->latency)
+		return;
+	latency_dump(server);
+	free(server->latency);
+	server->latency = NULL;
+}
+
+void
+latency_begin_event(struct server *server, uint64_t time_usec, bool gesture)
+{
+	struct latency_stats *stats = server->latency;
+	if (!stats)
+		return;
+	stats->event_time = time_usec;
+	stats->gesture = gesture;
+	stats->deferred = false;
+}
+
+void
+latency_begin_deferred_event(struct server *server, uint64_t time_usec)
+{
+	latency_begin_event(server, time_usec, false);
+	if (server->latency)
+		server->latency->deferred = true;
+}
+
+void
+latency_end_event(struct server *server)
+{
+	if (server->latency)
+		server->latency->event_time = 0;
+}
+
+void
+latency_mark(struct server *server, enum latency_path path)
+{
+	struct latency_stats *stats = server->latency;
+	if (!stats || !stats->event_time)
+		return;
+
+	if (path == LATENCY_COMMAND) {
+		// Commands are not written to uinput, so the spawn is the end
+		record(stats, path, stats->event_time, get_time_usec());
+		return;
+	}
+	if (stats->gesture)
+		path = LATENCY_GESTURE;
+	else if (stats->deferred)
+		path = LATENCY_TAP_HOLD;
+
+	// Record each path once per event
+	for (int i = stats->nr_pending - 1; i >= 0; i--) {
+		struct latency_sample *sample = &stats->pending[i];
+		if (sample->event_time != stats->event_time)
+			break;
+		if (sample->path == path)
+			return;
+	}
+	if (stats->nr_pending == MAX_PENDING_SAMPLES) {
+		stats->nr_skipped++;
+		return;
+	}
+	stats->pending[stats->nr_pending++] = (struct latency_sample){
+		.event_time = stats->event_time,
+		.path = path,
+	};
+}
+
+void
+latency_record_output(struct server *server)
+{
+	struct latency_stats *stats = server->latency;
+	if (!stats || !stats->nr_pending)
+		return;
+
+	uint64_t now = get_time_usec();
+	for (int i = 0; i < stats->nr_pending; i++) {
+		record(stats, stats->pending[i].path,
+		       stats->pending[i].event_time, now);
+	}
+	stats->nr_pending = 0;
+}
+
+void
+latency_dump(struct server *server)
+{
+	struct latency_stats *stats = server->latency;
+	if (!stats)
+		return;
+
+	fprintf(stderr, "%-14s %10s %8s %8s %8s %8s (usec)\n", "latency",
+		"count", "p50", "p99", "p999", "max");
+	for (int i = 0; i < LATENCY_NR_PATHS; i++) {
+		const struct histogram *histogram = &stats->histograms[i];
+		if (!histogram->count) {
+			fprintf(stderr, "%-14s %10d\n", path_names[i], 0);
+			continue;
+		}
+		fprintf(stderr, "%-14s %10" PRIu64 " %8" PRIu64 " %8" PRIu64
+				" %8" PRIu64 " %8" PRIu64 "\n",
+			path_names[i], histogram->count,
+			histogram_percentile(histogram, 50.),
+			histogram_percentile(histogram, 99.),
+			histogram_percentile(histogram, 99.9),
+			histogram->max);
+	}
+	if (stats->nr_skipped) {
+		fprintf(stderr, "%" PRIu64 " samples were skipped\n",
+			stats->nr_skipped);
+	}
+}
@@ -0,0 +1,155 @@
+#include "rydeen.h"
+#include <libevdev/libevdev.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Output backends that don't need /dev/uinput, to run rydeen headless or
+// to check the emitted events. They may be written from the action
+// thread too.
+
+#define RING_DEFAULT_SIZE 4096
+
+// Keeps the latest events, dropping the oldest ones when it's full
+struct ring {
+	pthread_mutex_t lock;
+	struct output_event *events;
+	size_t size, head, len;
+};
+
+static bool
+ring_init(struct server *server, const char *arg)
+{
+	long size = RING_DEFAULT_SIZE;
+	if (arg) {
+		char *end;
+		size = strtol(arg, &end, 10);
+		if (*end || size <= 0) {
+			fprintf(stderr, "Invalid ring size: %s\n", arg);
+			return false;
+		}
+	}
+	struct ring *ring = znew(*ring);
+	pthread_mutex_init(&ring->lock, NULL);
+	ring->events = calloc(size, sizeof(*ring->events));
+	ring->size = size;
+	server->uinput.backend_data = ring;
+	return true;
+}
+
+static void
+ring_write(struct server *server, enum output_device device,
+	   const struct input_event *events, int nr_events)
+{
+	struct ring *ring = server->uinput.backend_data;
+	pthread_mutex_lock(&ring->lock);
+	for (int i = 0; i < nr_events; i++) {
+		size_t tail = (ring->head + ring->len) % ring->size;
+		ring->events[tail] = (struct output_event){
+			.device = device,
+			.event = events[i],
+		};
+		if (ring->len == ring->size)
+			ring->head = (ring->head + 1) % ring->size;
+		else
+			ring->len++;
+	}
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void
+ring_finish(struct server *server)
+{
+	struct ring *ring = server->uinput.backend_data;
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->events);
+	free(ring);
+}
+
+size_t
+output_ring_read(struct server *server, struct output_event *events,
+		 size_t max_events)
+{
+	if (server->uinput.backend != &output_ring)
+		return 0;
+	// Events still in the buffer are not in the ring yet
+	uinput_flush(server);
+
+	struct ring *ring = server->uinput.backend_data;
+	size_t nr_events = 0;
+	pthread_mutex_lock(&ring->lock);
+	while (ring->len && nr_events < max_events) {
+		events[nr_events++] = ring->events[ring->head];
+		ring->head = (ring->head + 1) % ring->size;
+		ring->len--;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return nr_events;
+}
+
+const struct output_backend output_ring = {
+	.name = "ring",
+	.init = ring_init,
+	.write = ring_write,
+	.finish = ring_finish,
+};
+
+static bool
+file_init(struct server *server, const char *arg)
+{
+	if (!arg) {
+		fprintf(stderr, "The file output needs a path\n");
+		return false;
+	}
+	FILE *file = !strcmp(arg, "-") ? stdout : fopen(arg, "w");
+	if (!file) {
+		perror("Could not open output file");
+		return false;
+	}
+	server->uinput.backend_data = file;
+	return true;
+}
+
+// Writes a line like "keyboard EV_KEY KEY_A 1" for each event
+static void
+file_write(struct server *server, enum output_device device,
+	   const struct input_event *events, int nr_events)
+{
+	FILE *file = server->uinput.backend_data;
+	const char *device_name =
+		device == OUTPUT_KEYBOARD ? "keyboard" : "mouse";
+	flockfile(file);
+	for (int i = 0; i < nr_events; i++) {
+		const struct input_event *event = &events[i];
+		const char *type = libevdev_event_type_get_name(event->type);
+		const char *code =
+			libevdev_event_code_get_name(event->type, event->code);
+		fprintf(file, "%s %s ", device_name, type ? type : "?");
+		if (code)
+			fprintf(file, "%s", code);
+		else
+			fprintf(file, "%d", event->code);
+		fprintf(file, " %d\n", event->value);
+	}
+	// Readers of a pipe should see the events as they are sent
+	fflush(file);
+	funlockfile(file);
+}
+
+static void
+file_finish(struct server *server)
+{
+	FILE *file = server->uinput.backend_data;
+	if (file == stdout)
+		fflush(file);
+	else
+		fclose(file);
+}
+
+const struct output_backend output_file = {
+	.name = "file",
+	.init = file_init,
+	.write = file_write,
+	.finish = file_finish,
+};
@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include "rydeen.h"
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Stack touched at startup so that event handling doesn't fault on it
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+static void
+prefault_stack(void)
+{
+	volatile char stack[PREFAULT_STACK_SIZE];
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < sizeof(stack); i += page_size)
+		stack[i] = 0;
+}
+
+static void
+set_cpu_affinity(uint64_t cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < 64; cpu++) {
+		if (cpus & ((uint64_t)1 << cpu))
+			CPU_SET(cpu, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		fprintf(stderr, "Could not set CPU affinity: %s\n",
+			strerror(errno));
+	}
+}
+
+static void
+lock_memory(struct server *server)
+{
+	// Keep freed memory in the heap instead of returning it to the
+	// kernel, so reallocating it doesn't fault again
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		fprintf(stderr, "Could not lock memory: %s (LimitMEMLOCK= in "
+				"rydeen.service may be too low)\n",
+			strerror(errno));
+	}
+	prefault_stack();
+	realtime_prefault_config(&server->config);
+}
+
+static void
+set_realtime_priority(int priority)
+{
+	// Commands spawned by the daemon get the default policy
+	struct sched_param param = {.sched_priority = priority};
+	if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param)
+	    < 0) {
+		fprintf(stderr, "Could not set real-time priority: %s "
+				"(LimitRTPRIO= in rydeen.service may be too "
+				"low)\n",
+			strerror(errno));
+	}
+}
+
+void
+realtime_init(struct server *server)
+{
+	struct config *config = &server->config;
+
+	if (config->cpu_affinity)
+		set_cpu_affinity(config->cpu_affinity);
+	if (config->lock_memory)
+		lock_memory(server);
+	if (config->realtime_priority)
+		set_realtime_priority(config->realtime_priority);
+}
+
+void
+realtime_prefault_config(const struct config *config)
+{
+	volatile const char *arena = config->arena;
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < config->arena_size; i += page_size)
+		(void)arena[i];
+}
@@ -0,0 +1,242 @@
+#include "rydeen.h"
+#include <ev.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// A record file is the header followed by struct ryd_event in the order
+// they were read from libinput, in host byte order. bench/gen_session.py
+// writes it too, so bump both on changes.
+#define RECORD_MAGIC "RYDREC\0\0"
+#define RECORD_VERSION 1
+
+// Events dispatched at once when replaying at full speed
+#define REPLAY_BATCH_SIZE 64
+
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+};
+
+struct replay {
+	struct server *server;
+	struct ryd_event *events;
+	size_t nr_events;
+	size_t next;
+	// Time of the first recorded event and when the replay started
+	uint64_t first_time;
+	uint64_t start_time;
+	ev_idle idle;
+	ev_timer timer;
+};
+
+static uint64_t
+get_time_nsec(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool
+record_init(struct server *server, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		perror("Could not open record file");
+		return false;
+	}
+	struct record_header header = {
+		.magic = RECORD_MAGIC,
+		.version = RECORD_VERSION,
+		.event_size = sizeof(struct ryd_event),
+	};
+	if (fwrite(&header, sizeof(header), 1, file) != 1) {
+		perror("Could not write record file");
+		fclose(file);
+		return false;
+	}
+	server->record_file = file;
+	return true;
+}
+
+void
+record_event(struct server *server, const struct ryd_event *event)
+{
+	if (fwrite(event, sizeof(*event), 1, server->record_file) != 1) {
+		perror("Could not write record file");
+		record_finish(server);
+	}
+}
+
+void
+record_finish(struct server *server)
+{
+	if (!server->record_file)
+		return;
+	fclose(server->record_file);
+	server->record_file = NULL;
+}
+
+static struct ryd_event *
+load_events(const char *path, size_t *nr_events)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror("Could not open record file");
+		return NULL;
+	}
+
+	struct ryd_event *events = NULL;
+	struct record_header header;
+	struct stat st;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic))
+	    || header.version != RECORD_VERSION
+	    || header.event_size != sizeof(struct ryd_event)
+	    || fstat(fileno(file), &st) < 0) {
+		fprintf(stderr, "%s is not a valid record file\n", path);
+		goto out;
+	}
+
+	*nr_events = (st.st_size - sizeof(header)) / sizeof(*events);
+	events = calloc(*nr_events + 1, sizeof(*events));
+	if (fread(events, sizeof(*events), *nr_events, file) != *nr_events) {
+		fprintf(stderr, "Could not read %s\n", path);
+		free(events);
+		events = NULL;
+	}
+out:
+	fclose(file);
+	return events;
+}
+
+static void
+dispatch(struct replay *replay)
+{
+	// Timestamps are moved to the replay keeping the intervals between
+	// them, which gestures depend on. Latencies are meaningful only with
+	// --realtime.
+	struct ryd_event event = replay->events[replay->next++];
+	event.time_usec += replay->start_time - replay->first_time;
+	handle_input_event(replay->server, &replay->server->unknown_device,
+			   &event);
+}
+
+static void
+finish_batch(struct ev_loop *loop, struct replay *replay)
+{
+	latency_end_event(replay->server);
+	uinput_flush(replay->server);
+	if (replay->next == replay->nr_events)
+		ev_break(loop, EVBREAK_ONE);
+}
+
+static void
+handle_replay_idle(struct ev_loop *loop, ev_idle *w, int revents)
+{
+	struct replay *replay = w->data;
+	for (int i = 0; i < REPLAY_BATCH_SIZE; i++) {
+		if (replay->next == replay->nr_events)
+			break;
+		dispatch(replay);
+	}
+	finish_batch(loop, replay);
+}
+
+static void
+schedule_next_event(struct ev_loop *loop, struct replay *replay)
+{
+	if (replay->next == replay->nr_events)
+		return;
+	uint64_t offset =
+		replay->events[replay->next].time_usec - replay->first_time;
+	uint64_t now = get_time_nsec(CLOCK_MONOTONIC) / 1000;
+	uint64_t elapsed = now - replay->start_time;
+	double delay = offset > elapsed ? (offset - elapsed) / 1e6 : 0.;
+	ev_timer_set(&replay->timer, delay, 0.);
+	ev_timer_start(loop, &replay->timer);
+}
+
+static void
+handle_replay_timeout(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct replay *replay = w->data;
+	// Events with the same timestamp were read at once
+	uint64_t time_usec = replay->events[replay->next].time_usec;
+	while (replay->next < replay->nr_events
+	       && replay->events[replay->next].time_usec == time_usec)
+		dispatch(replay);
+	finish_batch(loop, replay);
+	schedule_next_event(loop, replay);
+}
+
+bool
+replay_run(struct server *server, const char *path, bool realtime)
+{
+	struct replay replay = {.server = server};
+	replay.events = load_events(path, &replay.nr_events);
+	if (!replay.events)
+		return false;
+	if (!replay.nr_events) {
+		fprintf(stderr, "%s has no events\n", path);
+		free(replay.events);
+		return false;
+	}
+
+	replay.first_time = replay.events[0].time_usec;
+	replay.idle.data = &replay;
+	ev_idle_init(&replay.idle, handle_replay_idle);
+	replay.timer.data = &replay;
+	ev_init(&replay.timer, handle_replay_timeout);
+
+	// Heap in use is the closest we get to allocations without
+	// interposing malloc
+	size_t heap_before = mallinfo2().uordblks;
+	uint64_t cpu_before = get_time_nsec(CLOCK_PROCESS_CPUTIME_ID);
+	uint64_t start = get_time_nsec(CLOCK_MONOTONIC);
+	replay.start_time = start / 1000;
+
+	if (realtime)
+		schedule_next_event(server->loop, &replay);
+	else
+		ev_idle_start(server->loop, &replay.idle);
+	ev_run(server->loop, 0);
+	ev_idle_stop(server->loop, &replay.idle);
+	ev_timer_stop(server->loop, &replay.timer);
+
+	// Pending key actions are part of the work for the events
+	action_flush(server);
+	uinput_flush(server);
+
+	uint64_t elapsed = get_time_nsec(CLOCK_MONOTONIC) - start;
+	uint64_t cpu = get_time_nsec(CLOCK_PROCESS_CPUTIME_ID) - cpu_before;
+	size_t heap_after = mallinfo2().uordblks;
+	double nr_events = replay.nr_events;
+
+	fprintf(stderr, "events         %zu\n", replay.nr_events);
+	fprintf(stderr, "events/sec     %.0f\n",
+		nr_events * 1e9 / (elapsed ? elapsed : 1));
+	fprintf(stderr, "cpu ns/event   %.1f\n", cpu / nr_events);
+	fprintf(stderr, "heap B/event   %.1f\n",
+		((double)heap_after - (double)heap_before) / nr_events);
+	fprintf(stderr, "output events  %" PRIu64 "\n",
+		server->uinput.nr_written);
+	fprintf(stderr, "commands       %" PRIu64 "\n",
+		server->nr_skipped_commands);
+	if (server->nr_recognized_swipes) {
+		fprintf(stderr, "swipes         %" PRIu64 "\n",
+			server->nr_recognized_swipes);
+		fprintf(stderr, "ms/swipe       %.1f\n",
+			server->swipe_recognition_usec / 1e3
+				/ server->nr_recognized_swipes);
+	}
+
+	free(replay.events);
+	return true;
+}
@@ -1,24 +1,20 @@
 #include "rydeen.h"
-#include <assert.h>
 #include <errno.h>
 #include <ev.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libevdev/libevdev-uinput.h>
 #include <libevdev/libevdev.h>
 #include <libinput.h>
 #include <libudev.h>
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-enum device_type {
-	DEVICE_NONE,
-	DEVICE_RYDEEN,
-	DEVICE_KEYBOARD,
-	DEVICE_TOUCHPAD,
-	DEVICE_MOUSE,
-};
-
 static enum device_type
 get_device_type(struct libevdev *evdev)
 {
@@ -44,19 +40,39 @@ get_device_type(struct libevdev *evdev)
 static int
 open_restricted(const char *path, int flags, void *user_data)
 {
+	struct server *server = user_data;
+	enum device_type type = device_classify(server, path);
+	switch (type) {
+	case DEVICE_RYDEEN:
+	case DEVICE_MOUSE:
+	case DEVICE_NONE:
+		debug("Found device: %s - ignored\n", path);
+		return -1;
+	default:
+		break;
+	}
+
 	int fd = open(path, flags);
 	if (fd < 0)
 		return -errno;
+	// Touchpads are only read by libinput
+	if (type == DEVICE_TOUCHPAD) {
+		debug("Found device: %s\n", path);
+		return fd;
+	}
 	struct libevdev *evdev;
 	if (libevdev_new_from_fd(fd, &evdev) < 0)
 		return fd;
 
 	debug("Found device: %s", libevdev_get_name(evdev));
 
-	switch (get_device_type(evdev)) {
+	if (type == DEVICE_UNKNOWN)
+		type = get_device_type(evdev);
+	switch (type) {
 	case DEVICE_RYDEEN:
 	case DEVICE_MOUSE:
 	case DEVICE_NONE:
+	case DEVICE_UNKNOWN:
 		debug(" - ignored\n");
 		libevdev_free(evdev);
 		close(fd);
@@ -66,6 +82,11 @@ open_restricted(const char *path, int flags, void *user_data)
 	case DEVICE_KEYBOARD:
 		debug(" - grabbed\n");
 		libevdev_grab(evdev, LIBEVDEV_GRAB);
+		if (server->config.direct_keyboards) {
+			// Read by us, libinput doesn't see the device
+			keyboard_add(server, fd, evdev);
+			return -1;
+		}
 		break;
 	}
 
@@ -85,142 +106,364 @@ static const struct libinput_interface interface = {
 	.close_restricted = close_restricted,
 };
 
+static void
+deactivate_modifier_keybinds(struct server *server, int index)
+{
+	struct config *config = &server->config;
+	uint32_t begin = config->modifier_keybind_offsets[index];
+	uint32_t end = config->modifier_keybind_offsets[index + 1];
+
+	for (uint32_t i = begin; i < end; i++) {
+		struct keybind *keybind = config->modifier_keybind_index[i];
+		if (keybind->active) {
+			keybind->active = false;
+			action_run(server, &keybind->on_release);
+		}
+	}
+}
+
 static bool
-handle_modifier_key(struct server *server, struct modifier *modifier,
-		    uint32_t keycode, bool pressed)
+handle_modifier_key(struct server *server, uint32_t keycode, bool pressed)
 {
-	bool handled = false;
-	bool activate = false;
-
-	tll_foreach(modifier->keys, it) {
-		if (ryd_set_contains(&server->pressed_keys, it->item.keycode))
-			activate = true;
-		if (keycode == it->item.keycode) {
-			assert(!handled);
-			handled = true;
-			if (it->item.send_keycode)
-				uinput_send(server, it->item.send_keycode,
-					    pressed, false);
+	struct config *config = &server->config;
+	struct modifier_state *state = &server->modifier_state;
+
+	if (keycode >= MAX_KEYCODE || !config->modifier_masks[keycode])
+		return false;
+
+	const struct modifier_key *key = config->modifier_keys[keycode];
+	if (key->send_keycode) {
+		latency_mark(server, LATENCY_PASSTHROUGH);
+		uinput_send(server, key->send_keycode, pressed, false);
+	}
+
+	modmask_t deactivated = 0;
+	modmask_t mask = config->modifier_masks[keycode];
+	while (mask) {
+		int index = __builtin_ctzll(mask);
+		modmask_t bit = (modmask_t)1 << index;
+		mask &= mask - 1;
+		if (pressed) {
+			if (state->nr_pressed[index]++ == 0)
+				state->active |= bit;
+		} else if (state->nr_pressed[index] > 0) {
+			if (--state->nr_pressed[index] == 0) {
+				state->active &= ~bit;
+				deactivated |= bit;
+			}
 		}
 	}
 
 	// When a modifier is deactivated, deactivate all the keybinds
 	// associated with it
-	if (modifier->activated && !activate) {
-		tll_foreach(server->config.keybinds, bind_it) {
-			bool deactivate_keybind = false;
-			tll_foreach(bind_it->item.modifiers, mod_it) {
-				if (mod_it->item == modifier) {
-					deactivate_keybind = true;
-					break;
-				}
-			}
-			if (deactivate_keybind && bind_it->item.active) {
-				bind_it->item.active = false;
-				action_run(server, &bind_it->item.on_release);
-			}
+	while (deactivated) {
+		deactivate_modifier_keybinds(server,
+					     __builtin_ctzll(deactivated));
+		deactivated &= deactivated - 1;
+	}
+
+	return true;
+}
+
+static void
+reset_tap_hold(struct server *server)
+{
+	struct tap_hold_state *state = &server->tap_hold;
+	state->key = NULL;
+	state->nr_queued = 0;
+	ev_timer_stop(server->loop, &state->timer);
+}
+
+// Handles the held back keys from the first-th one as usual
+static void
+replay_tap_hold(struct server *server, uint32_t first)
+{
+	struct tap_hold_state *state = &server->tap_hold;
+	struct deferred_key keys[TAP_HOLD_QUEUE_SIZE];
+	uint32_t nr_keys = state->nr_queued;
+	memcpy(keys, state->queue, nr_keys * sizeof(*keys));
+	reset_tap_hold(server);
+
+	for (uint32_t i = first; i < nr_keys; i++) {
+		const struct deferred_key *key = &keys[i];
+		latency_begin_deferred_event(server, key->time_usec);
+		if (!sequence_handle_key(server, key->device, key->time_usec,
+					 key->keycode, key->pressed)) {
+			process_key_event(server, key->device, key->keycode,
+					  key->pressed);
 		}
 	}
+}
 
-	modifier->activated = activate;
+void
+tap_hold_flush(struct server *server)
+{
+	if (server->tap_hold.key)
+		replay_tap_hold(server, 0);
+}
 
-	return handled;
+static void
+handle_tap_hold_timeout(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct server *server = w->data;
+	tap_hold_flush(server);
+	latency_end_event(server);
+	uinput_flush(server);
 }
 
+// A modifier key with a tap key is held back when pressed. Releasing it
+// first sends the tap key instead, while pressing another key or holding
+// it for tap_timeout makes it a modifier, which bounds the delay of the
+// keys. Keys released meanwhile are held back after it to keep the order.
 static bool
-handle_keybind_key(struct server *server, struct keybind *keybind,
-		   uint32_t keycode, bool pressed)
+handle_tap_hold_key(struct server *server, struct input_device *device,
+		    uint64_t time_usec, uint32_t keycode, bool pressed)
 {
-	if (keybind->keycode != keycode)
-		return false;
-	if (keybind->active == pressed)
-		return false;
+	struct tap_hold_state *state = &server->tap_hold;
+	struct config *config = &server->config;
 
-	tll_foreach(keybind->modifiers, it) {
-		if (!it->item->activated)
-			return false;
+	if (state->key) {
+		if (!pressed && keycode == state->key->keycode) {
+			uint32_t tap_keycode = state->key->tap_keycode;
+			replay_tap_hold(server, 1);
+			latency_begin_event(server, time_usec, false);
+			latency_mark(server, LATENCY_PASSTHROUGH);
+			// Written apart so that the press and the release get
+			// their own timestamps, as in key actions with
+			// key_interval
+			uinput_send(server, tap_keycode, true, false);
+			uinput_flush(server);
+			uinput_send(server, tap_keycode, false, false);
+			return true;
+		}
+		if (!pressed && state->nr_queued < TAP_HOLD_QUEUE_SIZE) {
+			struct deferred_key *key =
+				&state->queue[state->nr_queued++];
+			*key = (struct deferred_key){
+				.device = device,
+				.time_usec = time_usec,
+				.keycode = keycode,
+				.pressed = false,
+			};
+			return true;
+		}
+		tap_hold_flush(server);
+		latency_begin_event(server, time_usec, false);
 	}
 
-	keybind->active = pressed;
-	action_run(server, pressed ? &keybind->on_press : &keybind->on_release);
+	if (!pressed || keycode >= MAX_KEYCODE
+	    || !config->modifier_masks[keycode]
+	    || !config->modifier_keys[keycode]->tap_keycode)
+		return false;
+
+	state->key = config->modifier_keys[keycode];
+	state->queue[0] = (struct deferred_key){
+		.device = device,
+		.time_usec = time_usec,
+		.keycode = keycode,
+		.pressed = true,
+	};
+	state->nr_queued = 1;
+	ev_timer_init(&state->timer, handle_tap_hold_timeout,
+		      config->tap_timeout, 0.);
+	state->timer.data = server;
+	ev_timer_start(server->loop, &state->timer);
 	return true;
 }
 
+// Runs the most prioritized keybind of keycode whose modifiers are active,
+// and remembers it for the release. Returns false if there is none.
+static bool
+press_keybind(struct server *server, struct input_device *device,
+	      uint32_t keycode)
+{
+	struct config *config = &server->config;
+	struct keybind **index = config->keybind_index;
+	const uint32_t *offsets = config->keybind_offsets;
+	if (device->keybind_index) {
+		index = device->keybind_index;
+		offsets = device->keybind_offsets;
+	}
+
+	modmask_t active = server->modifier_state.active;
+	for (uint32_t i = offsets[keycode]; i < offsets[keycode + 1]; i++) {
+		struct keybind *keybind = index[i];
+		if ((active & keybind->modifiers) != keybind->modifiers)
+			continue;
+		device->keybinds[keycode] = keybind;
+		keybind->nr_held++;
+		// It may be held on another device
+		if (!keybind->active) {
+			keybind->active = true;
+			action_run(server, &keybind->on_press);
+		}
+		return true;
+	}
+	return false;
+}
+
 static void
-handle_key_event(struct server *server, enum libinput_event_type event_type,
-		 struct libinput_event *event)
+release_keybind(struct server *server, struct input_device *device,
+		uint32_t keycode)
+{
+	struct keybind *keybind = device->keybinds[keycode];
+	device->keybinds[keycode] = NULL;
+	if (!keybind)
+		return;
+	// Releasing the modifiers may have released it already
+	if (--keybind->nr_held || !keybind->active)
+		return;
+	keybind->active = false;
+	action_run(server, &keybind->on_release);
+}
+
+void
+process_key_event(struct server *server, struct input_device *device,
+		  uint32_t keycode, bool pressed)
 {
 	struct config *config = &server->config;
-	uint32_t keycode;
-	bool pressed;
-	if (event_type == LIBINPUT_EVENT_KEYBOARD_KEY) {
-		struct libinput_event_keyboard *kev =
-			libinput_event_get_keyboard_event(event);
-		keycode = libinput_event_keyboard_get_key(kev);
-		pressed = libinput_event_keyboard_get_key_state(kev)
-			  == LIBINPUT_KEY_STATE_PRESSED;
-	} else if (event_type == LIBINPUT_EVENT_POINTER_BUTTON) {
-		struct libinput_event_pointer *pev =
-			libinput_event_get_pointer_event(event);
-		keycode = libinput_event_pointer_get_button(pev);
-		pressed = libinput_event_pointer_get_button_state(pev)
-			  == LIBINPUT_BUTTON_STATE_PRESSED;
-	} else {
+
+	if (keycode >= MAX_KEYCODE) {
+		latency_mark(server, LATENCY_PASSTHROUGH);
+		uinput_send(server, keycode, pressed, true);
 		return;
 	}
 
+	if (pressed) {
+		if (!ryd_keyset_add(&device->pressed_keys, keycode))
+			return;
+		if (!config->modifier_masks[keycode]
+		    && press_keybind(server, device, keycode)) {
+			ryd_keyset_add(&device->bound_keys, keycode);
+			return;
+		}
+	} else {
+		if (!ryd_keyset_remove(&device->pressed_keys, keycode))
+			return;
+		// Released with the keybind it ran, even if it's not the one
+		// the device would run now
+		if (ryd_keyset_remove(&device->bound_keys, keycode)) {
+			release_keybind(server, device, keycode);
+			return;
+		}
+	}
+
+	// Other keys are pressed once for all the devices
+	if (pressed ? server->key_counts[keycode]++
+		    : --server->key_counts[keycode])
+		return;
 	if (pressed)
-		ryd_set_add(&server->pressed_keys, keycode);
+		ryd_keyset_add(&server->pressed_keys, keycode);
 	else
-		ryd_set_remove(&server->pressed_keys, keycode);
+		ryd_keyset_remove(&server->pressed_keys, keycode);
 
-	tll_foreach(config->modifiers, it) {
-		if (handle_modifier_key(server, &it->item, keycode, pressed))
-			return;
-	}
+	if (handle_modifier_key(server, keycode, pressed))
+		return;
+	latency_mark(server, LATENCY_PASSTHROUGH);
+	uinput_send(server, keycode, pressed, true);
+}
 
-	bool handled = false;
-	tll_foreach(config->keybinds, it) {
-		handled |=
-			handle_keybind_key(server, &it->item, keycode, pressed);
-	}
-	if (!handled)
-		uinput_send(server, keycode, pressed, true);
+// Maximum factor of swipe_thr between repeats of fast swipes
+#define SWIPE_MAX_STEP_SCALE 4.
+// Weight of the latest update in the smoothed velocity
+#define SWIPE_VELOCITY_WEIGHT 0.5
+
+static void
+update_swipe_velocity(struct swipe_state *state, const struct ryd_event *event)
+{
+	if (event->time_usec <= state->last_time)
+		return;
+	double dt = (event->time_usec - state->last_time) / 1e6;
+	state->vx += (event->dx / dt - state->vx) * SWIPE_VELOCITY_WEIGHT;
+	state->vy += (event->dy / dt - state->vy) * SWIPE_VELOCITY_WEIGHT;
+	state->last_time = event->time_usec;
+}
+
+// Returns the distance needed for the next action of the swipe. Faster
+// swipes take longer steps between repeats so flicks don't overshoot.
+static double
+get_swipe_step(const struct swipe_state *state, const struct config *config)
+{
+	if (!config->swipe_velocity || state->direction == DIRECTION_NONE)
+		return config->swipe_thr;
+	double scale = hypot(state->vx, state->vy) / config->swipe_velocity;
+	if (scale < 1.)
+		scale = 1.;
+	else if (scale > SWIPE_MAX_STEP_SCALE)
+		scale = SWIPE_MAX_STEP_SCALE;
+	return config->swipe_thr * scale;
+}
+
+// Returns the direction of a swipe not reaching swipe_thr yet if it's
+// fast and straight enough, or DIRECTION_NONE
+static enum direction
+predict_swipe_direction(const struct swipe_state *state,
+			const struct config *config)
+{
+	if (!config->swipe_velocity || state->direction != DIRECTION_NONE)
+		return DIRECTION_NONE;
+
+	bool horizontal = fabs(state->x) >= fabs(state->y);
+	double distance = horizontal ? state->x : state->y;
+	double off_axis = horizontal ? state->y : state->x;
+	double velocity = horizontal ? state->vx : state->vy;
+	if (fabs(distance) < config->swipe_min_distance)
+		return DIRECTION_NONE;
+	if (atan2(fabs(off_axis), fabs(distance)) * 180. / M_PI
+	    > config->swipe_angle)
+		return DIRECTION_NONE;
+	// The velocity must agree with the distance
+	if (velocity * copysign(1., distance) < config->swipe_velocity)
+		return DIRECTION_NONE;
+
+	if (horizontal)
+		return distance > 0 ? DIRECTION_RIGHT : DIRECTION_LEFT;
+	return distance > 0 ? DIRECTION_DOWN : DIRECTION_UP;
 }
 
 static void
-handle_gesture_event(struct server *server, enum libinput_event_type event_type,
-		     struct libinput_event *event)
+handle_gesture_event(struct server *server, struct input_device *device,
+		     const struct ryd_event *event)
 {
-	struct swipe_state *state = &server->swipe_state;
+	struct swipe_state *state = &device->swipe_state;
 	struct config *config = &server->config;
 
-	struct libinput_event_gesture *gesture_event =
-		libinput_event_get_gesture_event(event);
-	switch (event_type) {
-	case LIBINPUT_EVENT_GESTURE_SWIPE_BEGIN:
+	switch (event->type) {
+	case RYD_EVENT_SWIPE_BEGIN:
 		state->x = 0;
 		state->y = 0;
-		state->nr_fingers =
-			libinput_event_gesture_get_finger_count(gesture_event);
+		state->vx = 0;
+		state->vy = 0;
+		state->begin_time = event->time_usec;
+		state->last_time = event->time_usec;
+		state->nr_fingers = event->nr_fingers;
 		state->direction = DIRECTION_NONE;
 		break;
-	case LIBINPUT_EVENT_GESTURE_SWIPE_UPDATE: {
-		state->x += libinput_event_gesture_get_dx(gesture_event);
-		state->y += libinput_event_gesture_get_dy(gesture_event);
+	case RYD_EVENT_SWIPE_UPDATE: {
+		state->x += event->dx;
+		state->y += event->dy;
+		update_swipe_velocity(state, event);
+		double step = get_swipe_step(state, config);
 		enum direction ev_dir = 0;
-		if (state->x > config->swipe_thr) {
+		if (state->x > step) {
 			ev_dir = DIRECTION_RIGHT;
-			state->x -= config->swipe_thr;
-		} else if (state->x < -config->swipe_thr) {
+			state->x -= step;
+		} else if (state->x < -step) {
 			ev_dir = DIRECTION_LEFT;
-			state->x += config->swipe_thr;
-		} else if (state->y > config->swipe_thr) {
+			state->x += step;
+		} else if (state->y > step) {
 			ev_dir = DIRECTION_DOWN;
-			state->y -= config->swipe_thr;
-		} else if (state->y < -config->swipe_thr) {
+			state->y -= step;
+		} else if (state->y < -step) {
 			ev_dir = DIRECTION_UP;
-			state->y += config->swipe_thr;
+			state->y += step;
+		} else if ((ev_dir = predict_swipe_direction(state, config))) {
+			// The next step starts from here
+			if (ev_dir == DIRECTION_LEFT
+			    || ev_dir == DIRECTION_RIGHT)
+				state->x = 0;
+			else
+				state->y = 0;
 		} else {
 			break;
 		}
@@ -229,6 +472,9 @@ handle_gesture_event(struct server *server, enum libinput_event_type event_type,
 		if (state->direction == DIRECTION_NONE) {
 			state->direction = ev_dir;
 			repeating = false;
+			server->nr_recognized_swipes++;
+			server->swipe_recognition_usec +=
+				event->time_usec - state->begin_time;
 		} else if (ev_dir == state->direction
 			   || ev_dir == direction_opposite(state->direction)) {
 			repeating = true;
@@ -236,16 +482,18 @@ handle_gesture_event(struct server *server, enum libinput_event_type event_type,
 			break;
 		}
 
-		tll_foreach(config->gesturebinds, it) {
-			if (!it->item.repeat && repeating)
+		for (uint32_t i = 0; i < config->nr_gesturebinds; i++) {
+			const struct gesturebind *bind =
+				&config->gesturebinds[i];
+			if (!bind->repeat && repeating)
 				continue;
-			if (state->direction != it->item.direction
-			    || state->nr_fingers != it->item.nr_fingers)
+			if (state->direction != bind->direction
+			    || state->nr_fingers != bind->nr_fingers)
 				continue;
 			if (ev_dir == state->direction)
-				action_run(server, &it->item.on_forward);
+				action_run(server, &bind->on_forward);
 			else
-				action_run(server, &it->item.on_backward);
+				action_run(server, &bind->on_backward);
 		}
 		break;
 	}
@@ -254,6 +502,34 @@ handle_gesture_event(struct server *server, enum libinput_event_type event_type,
 	}
 }
 
+void
+handle_input_event(struct server *server, struct input_device *device,
+		   const struct ryd_event *event)
+{
+	if (server->record_file)
+		record_event(server, event);
+
+	switch (event->type) {
+	case RYD_EVENT_KEY:
+		latency_begin_event(server, event->time_usec, false);
+		if (handle_tap_hold_key(server, device, event->time_usec,
+					event->keycode, event->pressed))
+			break;
+		if (!sequence_handle_key(server, device, event->time_usec,
+					 event->keycode, event->pressed)) {
+			process_key_event(server, device, event->keycode,
+					  event->pressed);
+		}
+		break;
+	case RYD_EVENT_SWIPE_BEGIN:
+	case RYD_EVENT_SWIPE_UPDATE:
+	case RYD_EVENT_SWIPE_END:
+		latency_begin_event(server, event->time_usec, true);
+		handle_gesture_event(server, device, event);
+		break;
+	}
+}
+
 static void
 on_li_events_ready(struct ev_loop *loop, ev_io *w, int revents)
 {
@@ -265,37 +541,330 @@ on_li_events_ready(struct ev_loop *loop, ev_io *w, int revents)
 
 	struct libinput_event *event;
 	while ((event = libinput_get_event(li))) {
-		enum libinput_event_type event_type =
-			libinput_event_get_type(event);
-		switch (event_type) {
+		struct libinput_device *li_device =
+			libinput_event_get_device(event);
+		struct input_device *device =
+			libinput_device_get_user_data(li_device);
+		struct ryd_event ryd_event = {0};
+		switch (libinput_event_get_type(event)) {
+		case LIBINPUT_EVENT_DEVICE_ADDED:
+			device = input_device_create(
+				server, libinput_device_get_name(li_device),
+				libinput_device_get_id_vendor(li_device),
+				libinput_device_get_id_product(li_device));
+			libinput_device_set_user_data(li_device, device);
+			libinput_event_destroy(event);
+			continue;
+		case LIBINPUT_EVENT_DEVICE_REMOVED:
+			input_device_destroy(server, device);
+			libinput_device_set_user_data(li_device, NULL);
+			libinput_event_destroy(event);
+			continue;
 		case LIBINPUT_EVENT_KEYBOARD_KEY:
-			handle_key_event(server, event_type, event);
+			ryd_event.type = RYD_EVENT_KEY;
 			break;
 		case LIBINPUT_EVENT_GESTURE_SWIPE_BEGIN:
+			ryd_event.type = RYD_EVENT_SWIPE_BEGIN;
+			break;
 		case LIBINPUT_EVENT_GESTURE_SWIPE_UPDATE:
+			ryd_event.type = RYD_EVENT_SWIPE_UPDATE;
+			break;
 		case LIBINPUT_EVENT_GESTURE_SWIPE_END:
-			handle_gesture_event(server, event_type, event);
+			ryd_event.type = RYD_EVENT_SWIPE_END;
 			break;
 		default:
-			break;
+			libinput_event_destroy(event);
+			continue;
+		}
+
+		if (ryd_event.type == RYD_EVENT_KEY) {
+			struct libinput_event_keyboard *kev =
+				libinput_event_get_keyboard_event(event);
+			ryd_event.time_usec =
+				libinput_event_keyboard_get_time_usec(kev);
+			ryd_event.keycode =
+				libinput_event_keyboard_get_key(kev);
+			ryd_event.pressed =
+				libinput_event_keyboard_get_key_state(kev)
+				== LIBINPUT_KEY_STATE_PRESSED;
+		} else {
+			struct libinput_event_gesture *gev =
+				libinput_event_get_gesture_event(event);
+			ryd_event.time_usec =
+				libinput_event_gesture_get_time_usec(gev);
+			ryd_event.nr_fingers =
+				libinput_event_gesture_get_finger_count(gev);
+			ryd_event.dx = libinput_event_gesture_get_dx(gev);
+			ryd_event.dy = libinput_event_gesture_get_dy(gev);
 		}
 		libinput_event_destroy(event);
+
+		handle_input_event(server, device, &ryd_event);
 	}
+	latency_end_event(server);
+	uinput_flush(server);
 	ev_io_start(loop, w);
 }
 
+// Returns the key held by uinput while keycode is pressed
+static uint32_t
+get_held_keycode(struct config *config, uint32_t keycode)
+{
+	if (config->modifier_masks[keycode])
+		return config->modifier_keys[keycode]->send_keycode;
+	return keycode;
+}
+
+static void
+reload_config(struct server *server)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct config new_config = {0};
+	if (!config_load(&new_config, true)) {
+		fprintf(stderr, "Could not reload config, keeping the current "
+				"one\n");
+		return;
+	}
+
+	struct config *config = &server->config;
+	struct modifier_state *state = &server->modifier_state;
+
+	// Key actions, the tap-hold key and the sequence matcher refer to
+	// the current config
+	tap_hold_flush(server);
+	sequence_flush(server);
+	action_flush(server);
+
+	// Replace the keys held for the pressed keys with the ones the new
+	// config sends, and recount the pressed keys of modifiers. A key
+	// which is no longer a modifier is pressed as it is, as its release
+	// will be passed through.
+	*state = (struct modifier_state){0};
+	for (int i = 0; i < ARRAY_SIZE(server->pressed_keys.words); i++) {
+		uint64_t word = server->pressed_keys.words[i];
+		while (word) {
+			uint32_t keycode = i * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+
+			uint32_t held = get_held_keycode(config, keycode);
+			uint32_t new_held = keycode;
+			modmask_t mask = new_config.modifier_masks[keycode];
+			if (mask) {
+				new_held = new_config.modifier_keys[keycode]
+						   ->send_keycode;
+			}
+			if (held != new_held) {
+				// Stops the repeat of held if it's repeating
+				if (held)
+					uinput_send(server, held, false, true);
+				if (new_held)
+					uinput_send(server, new_held, true,
+						    false);
+			}
+
+			state->active |= mask;
+			while (mask) {
+				state->nr_pressed[__builtin_ctzll(mask)]++;
+				mask &= mask - 1;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < config->nr_keybinds; i++) {
+		struct keybind *keybind = &config->keybinds[i];
+		if (keybind->active) {
+			keybind->active = false;
+			action_run(server, &keybind->on_release);
+		}
+	}
+	action_flush(server);
+	uinput_flush(server);
+	action_thread_sync(server, &new_config);
+
+	config_free(config);
+	*config = new_config;
+	action_init(server);
+	input_device_reload(server);
+	if (config->lock_memory)
+		realtime_prefault_config(config);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "Reloaded config in %.3f ms\n",
+		(end.tv_sec - start.tv_sec) * 1e3
+			+ (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+static void
+handle_sighup(struct ev_loop *loop, ev_signal *w, int revents)
+{
+	reload_config(w->data);
+}
+
+static void
+handle_reload_timeout(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	reload_config(w->data);
+}
+
+static void
+handle_config_changed(struct ev_loop *loop, ev_stat *w, int revents)
+{
+	struct server *server = w->data;
+
+	// Editors may write the file in several steps
+	ev_timer_stop(loop, &server->reload_timer);
+	ev_timer_set(&server->reload_timer, 0.1, 0.);
+	ev_timer_start(loop, &server->reload_timer);
+}
+
+static void
+handle_sigusr1(struct ev_loop *loop, ev_signal *w, int revents)
+{
+	latency_dump(w->data);
+}
+
+static void
+handle_terminate(struct ev_loop *loop, ev_signal *w, int revents)
+{
+	ev_break(loop, EVBREAK_ALL);
+}
+
+#if HAVE_IO_URING
+#define URING_OUTPUT_USAGE "uring, "
+#else
+#define URING_OUTPUT_USAGE ""
+#endif
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -c, --compile      Compile the config file into %s and "
+		"exit\n"
+		"  -l, --latency      Measure latencies, shown on SIGUSR1 and "
+		"exit\n"
+		"  -r, --record FILE  Record input events into FILE\n"
+		"  -p, --replay FILE  Replay events recorded in FILE without "
+		"output and exit\n"
+		"  -R, --realtime     Replay events at the recorded pace\n"
+		"  -o, --output OUT   Send events to OUT: uinput (default), "
+		URING_OUTPUT_USAGE "ring[:SIZE]\n"
+		"                     or file:PATH (- for stdout)\n"
+		"  -b, --bench[=NAME] Run the benchmarks whose names begin "
+		"with NAME and exit\n"
+		"  -h, --help         Show this help\n",
+		argv0, RYDEEN_CACHE_PATH);
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
+	static const struct option long_options[] = {
+		{"compile", no_argument, NULL, 'c'},
+		{"latency", no_argument, NULL, 'l'},
+		{"record", required_argument, NULL, 'r'},
+		{"replay", required_argument, NULL, 'p'},
+		{"realtime", no_argument, NULL, 'R'},
+		{"output", required_argument, NULL, 'o'},
+		{"bench", optional_argument, NULL, 'b'},
+		{"help", no_argument, NULL, 'h'},
+		{0},
+	};
+	bool compile = false;
+	bool latency = false;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	bool realtime = false;
+	const char *output = NULL;
+	bool bench = false;
+	const char *bench_prefix = NULL;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "clr:p:Ro:b::h", long_options,
+				  NULL))
+	       != -1) {
+		switch (opt) {
+		case 'c':
+			compile = true;
+			break;
+		case 'l':
+			latency = true;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'p':
+			replay_path = optarg;
+			break;
+		case 'R':
+			realtime = true;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'b':
+			bench = true;
+			bench_prefix = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
 	struct server server = {0};
+
+	if (compile) {
+		bool compiled = config_compile(&server);
+		config_finish(&server);
+		return compiled ? 0 : 1;
+	}
+
+	if (bench)
+		return bench_run(bench_prefix) ? 0 : 1;
+
 	server.loop = ev_default_loop(0);
 
-	config_init(&server);
-	uinput_init(&server);
+	if (replay_path) {
+		server.dry_run = true;
+		config_init(&server);
+		action_init(&server);
+		if (latency)
+			latency_init(&server);
+		bool replayed = uinput_init(&server, output ? output : "ring")
+				&& replay_run(&server, replay_path, realtime);
+		action_finish(&server);
+		uinput_finish(&server);
+		latency_finish(&server);
+		config_finish(&server);
+		return replayed ? 0 : 1;
+	}
+
+	if (record_path && !record_init(&server, record_path))
+		return 1;
 
-	struct udev *udev = udev_new();
-	server.li = libinput_udev_create_context(&interface, NULL, udev);
-	udev_unref(udev);
+	config_init(&server);
+	action_init(&server);
+	if (latency)
+		latency_init(&server);
+	// Fork the helper before any device is opened
+	spawn_helper_init(&server);
+	if (!uinput_init(&server, output))
+		return 1;
+	realtime_init(&server);
+	if (server.config.action_thread)
+		action_thread_init(&server);
+
+	// Kept for device_classify
+	server.udev = udev_new();
+	server.li = libinput_udev_create_context(&interface, &server,
+						 server.udev);
 	libinput_udev_assign_seat(server.li, "seat0");
 
 	server.li_watcher.data = &server;
@@ -303,10 +872,39 @@ main(void)
 		   libinput_get_fd(server.li), EV_READ);
 	on_li_events_ready(server.loop, &server.li_watcher, 0);
 
+	server.sighup_watcher.data = &server;
+	ev_signal_init(&server.sighup_watcher, handle_sighup, SIGHUP);
+	ev_signal_start(server.loop, &server.sighup_watcher);
+	server.sigusr1_watcher.data = &server;
+	ev_signal_init(&server.sigusr1_watcher, handle_sigusr1, SIGUSR1);
+	ev_signal_start(server.loop, &server.sigusr1_watcher);
+	ev_signal_init(&server.sigint_watcher, handle_terminate, SIGINT);
+	ev_signal_start(server.loop, &server.sigint_watcher);
+	ev_signal_init(&server.sigterm_watcher, handle_terminate, SIGTERM);
+	ev_signal_start(server.loop, &server.sigterm_watcher);
+	server.reload_timer.data = &server;
+	ev_init(&server.reload_timer, handle_reload_timeout);
+	// The file may have been removed since it was loaded. SIGHUP still
+	// reloads it then.
+	const char *config_path = config_find_path();
+	if (config_path) {
+		server.config_watcher.data = &server;
+		ev_stat_init(&server.config_watcher, handle_config_changed,
+			     config_path, 0.);
+		ev_stat_start(server.loop, &server.config_watcher);
+	}
+
 	ev_run(server.loop, 0);
 
 	libinput_unref(server.li);
+	keyboard_finish(&server);
+	device_finish(&server);
+	action_thread_finish(&server);
+	action_finish(&server);
 	uinput_finish(&server);
+	spawn_helper_finish(&server);
+	latency_finish(&server);
+	record_finish(&server);
 	config_finish(&server);
 
 	return 0;
@@ -2,23 +2,39 @@
 
 #include "util.h"
 #include <ev.h>
+#include <linux/input.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include <tllist.h>
 
 struct libinput;
 struct libevdev;
+struct udev;
+struct libevdev_uinput;
+struct server;
+struct action_write;
+struct parser_context;
+
+#define MAX_MODIFIERS 64
+
+// Set of modifiers, where bit N represents the Nth modifier in the config
+typedef uint64_t modmask_t;
 
 struct modifier_key {
 	uint32_t keycode;
 	uint32_t send_keycode;
+	// Key sent instead when the key is tapped, or 0 if it's always a
+	// modifier
+	uint32_t tap_keycode;
 };
 
 struct modifier {
 	const char *name;
 	// The modifier is activated when any of keys are pressed
-	tll(struct modifier_key) keys;
-	bool activated;
+	const struct modifier_key *keys;
+	uint32_t nr_keys;
 };
 
 struct key_signal {
@@ -28,22 +44,49 @@ struct key_signal {
 
 typedef tll(struct key_signal) key_signals_t;
 
+enum action_type {
+	ACTION_NONE = 0,
+	ACTION_KEY,
+	ACTION_COMMAND,
+};
+
 struct action {
-	enum { ACTION_NONE = 0, ACTION_KEY, ACTION_COMMAND } type;
+	enum action_type type;
 	union {
 		// type == ACTION_KEY
-		key_signals_t signals;
+		struct {
+			const struct key_signal *signals;
+			uint32_t nr_signals;
+			// The signals compiled into the events written when
+			// they are sent at once
+			const struct action_write *writes;
+			uint32_t nr_writes;
+			// Whether a key of the virtual keyboard is pressed,
+			// and the key auto-repeated after the action then
+			bool presses_key;
+			uint32_t repeat_keycode;
+		};
 		// type == ACTION_COMMAND
-		const char *cmd;
+		struct {
+			const char *cmd;
+			// Words of cmd executed without shell, or NULL if cmd
+			// needs to be run by shell
+			char **argv;
+		};
 	};
 };
 
 struct keybind {
 	uint32_t keycode;
-	tll(struct modifier *) modifiers; // not owned
+	modmask_t modifiers;
+	// Name or "vendor:product" of the device the keybind is limited to,
+	// or NULL for any device
+	const char *device;
 	struct action on_press;
 	struct action on_release;
 	bool active;
+	// Number of devices holding its key
+	uint32_t nr_held;
 };
 
 struct gesturebind {
@@ -54,49 +97,554 @@ struct gesturebind {
 	struct action on_backward;
 };
 
+#define MAX_SEQUENCE_KEYS 16
+
+// Keys pressed one after another, with at most timeout seconds between
+// them
+struct sequence {
+	const uint32_t *keycodes;
+	uint32_t nr_keys;
+	double timeout;
+	struct action on_match;
+};
+
+// State of the sequence matcher, which is a prefix of some sequences.
+// State 0 is the empty prefix.
+struct sequence_state {
+	// The sequence ending here, or NULL
+	const struct sequence *match;
+	// Longest timeout of the sequences starting with the prefix
+	double timeout;
+};
+
+// Transition of the sequence matcher, in an open addressing hash table
+struct sequence_transition {
+	uint32_t state;
+	uint32_t keycode;
+	// 0 if the slot is empty, as no transition leads to state 0
+	uint32_t next;
+};
+
+// How a key action is scheduled while others are sending signals with
+// key_interval
+enum key_action_policy {
+	// Wait until the previous key actions are done
+	KEY_ACTION_SERIALIZE = 0,
+	// Send the next signal of every key action at each interval
+	KEY_ACTION_INTERLEAVE,
+	// Discard the key action
+	KEY_ACTION_DROP,
+};
+
 struct config {
 	double swipe_thr;
+	// Speed of swipes to be recognized before swipe_thr, or 0 to always
+	// wait for swipe_thr
+	double swipe_velocity;
+	// Distance and maximum angle from the axis needed for that
+	double swipe_min_distance;
+	double swipe_angle;
 	double key_interval;
+	enum key_action_policy key_action_policy;
+	// Maximum number of key actions waiting for key_interval
+	uint32_t key_action_queue_size;
 	double key_repeat_delay;
 	double key_repeat_interval;
+	// Time after which a key with a tap key is held instead of tapped
+	double tap_timeout;
+	bool spawn_helper;
+	bool action_thread;
+	// Read keyboards with libevdev instead of libinput
+	bool direct_keyboards;
+	// SCHED_FIFO priority of the input thread, or 0 to not change it
+	int realtime_priority;
+	bool lock_memory;
+	// CPUs to run the daemon on, or 0 for any
+	uint64_t cpu_affinity;
+	// RMLVO names the keycodes were resolved with, or NULL for the
+	// defaults, and a hash of the keymap compiled from them
+	const char *rmlvo[5];
+	uint64_t keymap_hash;
+
+	// Single allocation holding all the arrays below and the strings
+	// they refer to
+	void *arena;
+	size_t arena_size;
+	struct modifier *modifiers;
+	uint32_t nr_modifiers;
+	struct keybind *keybinds;
+	uint32_t nr_keybinds;
+	struct gesturebind *gesturebinds;
+	uint32_t nr_gesturebinds;
+	struct sequence *sequences;
+	uint32_t nr_sequences;
+
+	// Matcher of the sequences, taking a state and a keycode to the
+	// next state through sequence_table
+	struct sequence_state *sequence_states;
+	struct sequence_transition *sequence_table;
+	uint32_t sequence_table_mask;
+
+	// Keybinds for any device grouped by keycode. Candidates for a
+	// keycode are keybind_index[keybind_offsets[keycode]] to
+	// keybind_index[keybind_offsets[keycode + 1] - 1], most prioritized
+	// (i.e. defined later) first.
+	struct keybind **keybind_index;
+	uint32_t keybind_offsets[MAX_KEYCODE + 1];
+
+	// Events of all the key actions, taken by action_write. Each signal
+	// is at most one write and two events.
+	struct input_event *action_events;
+	struct action_write *action_writes;
+
+	// Modifiers triggered by each keycode
+	modmask_t modifier_masks[MAX_KEYCODE];
+	// The first modifier key with each keycode, which decides the key
+	// sent by uinput
+	const struct modifier_key *modifier_keys[MAX_KEYCODE];
+	// Keybinds requiring the Nth modifier are
+	// modifier_keybind_index[modifier_keybind_offsets[N]] to
+	// modifier_keybind_index[modifier_keybind_offsets[N + 1] - 1]
+	struct keybind **modifier_keybind_index;
+	uint32_t modifier_keybind_offsets[MAX_MODIFIERS + 1];
+};
+
+// Number of items in the arena of a config
+struct config_size {
+	uint32_t nr_modifiers;
+	uint32_t nr_modifier_keys;
+	uint32_t nr_keybinds;
+	uint32_t nr_gesturebinds;
+	uint32_t nr_sequences;
+	// Sum of the number of keys of each sequence
+	uint32_t nr_sequence_keys;
+	uint32_t nr_signals;
+	// Sum of the number of modifiers of each keybind
+	uint32_t nr_modifier_keybinds;
+	// Words of argv including the terminating NULLs
+	uint32_t nr_args;
+	uint32_t strings_size;
+};
 
-	tll(struct modifier) modifiers;
-	tll(struct keybind) keybinds;
-	tll(struct gesturebind) gesturebinds;
+// Unused parts of the arena, taken from the front while it's filled
+struct config_arena {
+	struct modifier_key *modifier_keys;
+	uint32_t *sequence_keys;
+	struct key_signal *signals;
+	char **args;
+	char *strings;
+};
+
+enum ryd_event_type {
+	RYD_EVENT_KEY,
+	RYD_EVENT_SWIPE_BEGIN,
+	RYD_EVENT_SWIPE_UPDATE,
+	RYD_EVENT_SWIPE_END,
+};
+
+// Input event taken from libinput. This is also the record of the files
+// written by --record.
+struct ryd_event {
+	uint64_t time_usec;
+	uint8_t type;
+	uint8_t pressed;
+	uint8_t nr_fingers;
+	uint8_t reserved;
+	uint32_t keycode;
+	float dx, dy;
+};
+
+struct modifier_state {
+	modmask_t active;
+	// Number of pressed keys triggering each modifier
+	uint16_t nr_pressed[MAX_MODIFIERS];
 };
 
 struct swipe_state {
 	double x, y;
+	// Smoothed velocity in distance per second
+	double vx, vy;
+	uint64_t begin_time, last_time;
 	enum direction direction;
 	bool active;
 	bool reversing;
 	int nr_fingers;
 };
 
+#define UINPUT_BUFFER_SIZE 128
+
+// Virtual devices the events are sent from
+enum output_device {
+	OUTPUT_KEYBOARD,
+	OUTPUT_MOUSE,
+	OUTPUT_NR_DEVICES,
+};
+
+static inline enum output_device
+get_output_device(uint32_t keycode)
+{
+	return keycode < 256 ? OUTPUT_KEYBOARD : OUTPUT_MOUSE;
+}
+
+// Events of a key action for one device, with a SYN_REPORT after each key
+struct action_write {
+	enum output_device device;
+	uint32_t nr_events;
+	const struct input_event *events;
+};
+
+// Destination of the events sent by uinput_send()
+struct output_backend {
+	const char *name;
+	// arg is the part after ':' in --output, or NULL
+	bool (*init)(struct server *server, const char *arg);
+	// Writes at most UINPUT_BUFFER_SIZE events
+	void (*write)(struct server *server, enum output_device device,
+		      const struct input_event *events, int nr_events);
+	// Optional, called once the writes of a flush are done
+	void (*flush)(struct server *server);
+	void (*finish)(struct server *server);
+};
+
+// Event stored by the ring backend
+struct output_event {
+	enum output_device device;
+	struct input_event event;
+};
+
 struct uinput {
 	struct server *server;
-	struct libevdev_uinput *keyboard, *mouse;
+	const struct output_backend *backend;
+	void *backend_data;
 	struct ev_timer repeat_timer;
 	uint32_t last_keycode;
+	// Set for the output of the action thread, whose keys are repeated
+	// by the input thread so that only one key repeats at a time
+	bool shared;
+
+	// Number of events written
+	uint64_t nr_written;
+
+	// Events not written yet. They are all for buffer_device, so the
+	// buffer is flushed before an event for the other device is queued.
+	struct input_event buffer[UINPUT_BUFFER_SIZE];
+	int buffer_len;
+	enum output_device buffer_device;
+};
+
+struct spawn_helper {
+	pid_t pid;
+	// Socket connected to the helper process, or -1 if it's not running
+	int fd;
+	struct ev_io watcher;
+};
+
+// Paths of events through the daemon whose latency is measured
+enum latency_path {
+	LATENCY_PASSTHROUGH,
+	LATENCY_KEY_ACTION,
+	LATENCY_COMMAND,
+	LATENCY_GESTURE,
+	// Keys held back while a tap-hold key is pending
+	LATENCY_TAP_HOLD,
+	LATENCY_NR_PATHS,
+};
+
+struct latency_stats;
+struct action_thread;
+
+struct pending_key_action {
+	// The next signal to send, and the end of the signals
+	const struct key_signal *signal, *end;
+};
+
+// Key of a sequence being typed, which is sent as usual if the sequence
+// isn't completed
+struct deferred_key {
+	struct input_device *device;
+	uint64_t time_usec;
+	uint32_t keycode;
+	bool pressed;
+};
+
+struct sequence_matcher {
+	uint32_t state;
+	// Presses of the keys in the state and the releases following them
+	struct deferred_key keys[2 * MAX_SEQUENCE_KEYS];
+	uint32_t nr_keys;
+	struct ryd_keyset deferred_pressed;
+	// Keys of completed sequences whose releases are dropped
+	struct ryd_keyset swallowed;
+	struct ev_timer timer;
+};
+
+// Events held back while a tap-hold key is pending, including its press
+#define TAP_HOLD_QUEUE_SIZE 16
+
+// Modifier key with a tap key, which is held back until it's released
+// (a tap), another key is pressed or tap_timeout passes (a hold)
+struct tap_hold_state {
+	// The pending key, or NULL
+	const struct modifier_key *key;
+	// The press of the key followed by the releases of other keys
+	struct deferred_key queue[TAP_HOLD_QUEUE_SIZE];
+	uint32_t nr_queued;
+	struct ev_timer timer;
+};
+
+// Key actions sending signals with key_interval, driven by one timer
+struct key_action_queue {
+	// Ring buffer allocated for key_action_queue_size items
+	struct pending_key_action *items;
+	uint32_t size;
+	uint32_t head;
+	uint32_t len;
+	struct ev_timer timer;
+};
+
+enum device_type {
+	DEVICE_NONE,
+	DEVICE_RYDEEN,
+	DEVICE_KEYBOARD,
+	DEVICE_TOUCHPAD,
+	DEVICE_MOUSE,
+	// udev can't tell, the device must be opened to classify it
+	DEVICE_UNKNOWN,
+};
+
+struct device_class {
+	char *syspath;
+	enum device_type type;
+};
+
+// Input device from libinput or a keyboard read directly. Keys, keybinds
+// and swipes are tracked for each device, while modifiers are shared as
+// they apply to the same virtual keyboard.
+struct input_device {
+	char *name;
+	// "vendor:product" in hex
+	char id[10];
+	struct swipe_state swipe_state;
+	// Keybinds of the device grouped like those of the config, or NULL
+	// if no keybind is limited to this device
+	struct keybind **keybind_index;
+	uint32_t *keybind_offsets;
+	struct ryd_keyset pressed_keys;
+	// Keys whose press ran a keybind, and the keybind their release
+	// runs
+	struct ryd_keyset bound_keys;
+	struct keybind *keybinds[MAX_KEYCODE];
+};
+
+// Keyboard read with libevdev instead of libinput
+struct keyboard {
+	struct server *server;
+	struct input_device *device;
+	struct libevdev *evdev;
+	struct ev_io watcher;
+	// Keys pressed on this keyboard
+	struct ryd_keyset pressed_keys;
 };
 
 struct server {
 	struct ev_loop *loop;
 	struct ev_io li_watcher;
 	struct libinput *li;
+	struct udev *udev;
+	// Devices classified from their udev properties
+	tll(struct device_class) device_classes;
+	tll(struct input_device *) devices;
+	// Device of the events from --replay and --bench
+	struct input_device unknown_device;
+	tll(struct keyboard *) keyboards;
+	// Number of devices pressing each key not taken by a keybind, so
+	// that it's sent once and released when the last device releases it
+	uint8_t key_counts[MAX_KEYCODE];
 	struct uinput uinput;
 	struct config config;
-	struct ryd_set pressed_keys;
-	struct swipe_state swipe_state;
+	// Keys counted in key_counts
+	struct ryd_keyset pressed_keys;
+	struct modifier_state modifier_state;
+	struct spawn_helper spawn_helper;
+	struct key_action_queue key_actions;
+	struct sequence_matcher sequence_matcher;
+	struct tap_hold_state tap_hold;
+	// Latency histograms, or NULL if they are not enabled
+	struct latency_stats *latency;
+	// Thread running the actions, or NULL if they are run on this one
+	struct action_thread *action_thread;
+	// Input events are written here with --record
+	FILE *record_file;
+	// Don't run commands, to replay recorded events
+	bool dry_run;
+	// Commands skipped by dry_run
+	uint64_t nr_skipped_commands;
+	// Swipes whose direction was recognized and the total time from the
+	// beginning of them to the recognition
+	uint64_t nr_recognized_swipes;
+	uint64_t swipe_recognition_usec;
+
+	struct ev_signal sighup_watcher;
+	struct ev_signal sigusr1_watcher;
+	struct ev_signal sigint_watcher;
+	struct ev_signal sigterm_watcher;
+	struct ev_stat config_watcher;
+	struct ev_timer reload_timer;
 };
 
+void handle_input_event(struct server *server, struct input_device *device,
+			const struct ryd_event *event);
+// Handles a key which is not part of a sequence
+void process_key_event(struct server *server, struct input_device *device,
+		       uint32_t keycode, bool pressed);
+
+// Decides a pending tap-hold key as held
+void tap_hold_flush(struct server *server);
+
+// Returns true if the key is taken by the sequence matcher
+bool sequence_handle_key(struct server *server, struct input_device *device,
+			 uint64_t time_usec, uint32_t keycode, bool pressed);
+// Processes the keys of an unfinished sequence as usual
+void sequence_flush(struct server *server);
+
+// Classifies the device node at path without opening it
+enum device_type device_classify(struct server *server, const char *path);
+void device_finish(struct server *server);
+struct input_device *input_device_create(struct server *server,
+					 const char *name, int vendor_id,
+					 int product_id);
+void input_device_destroy(struct server *server, struct input_device *device);
+// Rebuilds the keybinds of the devices for a new config
+void input_device_reload(struct server *server);
+// Returns true if scope is the name or the id of device
+bool input_device_matches(const struct input_device *device,
+			  const char *scope);
+
+// Reads the grabbed keyboard from fd. Takes fd and evdev.
+void keyboard_add(struct server *server, int fd, struct libevdev *evdev);
+void keyboard_finish(struct server *server);
+
+bool is_rydeen_id(int vendor_id, int product_id);
 bool is_rydeen_device(struct libevdev *evdev);
-void uinput_init(struct server *server);
+// output is "<backend>[:<arg>]", or NULL for uinput
+bool uinput_init(struct server *server, const char *output);
 void uinput_finish(struct server *server);
 void uinput_send(struct server *server, uint32_t keycode, bool press,
 		 bool repeat);
+// Sends all the signals of a key action, same as uinput_send() for each
+void uinput_send_action(struct server *server, const struct action *action);
+// Starts or stops the key repeat as the signals of a key action do
+void uinput_repeat_action(struct server *server, const struct action *action);
+void uinput_flush(struct server *server);
+// Sets up the output of server to write to the backend of owner, from
+// another thread
+void uinput_init_shared(struct server *server, const struct server *owner);
+void uinput_finish_shared(struct server *server);
+// Creates the virtual keyboard and mouse, indexed by enum output_device
+void uinput_create_devices(struct libevdev_uinput **devices);
+void uinput_destroy_devices(struct libevdev_uinput **devices);
+
+extern const struct output_backend output_uinput;
+#if HAVE_IO_URING
+extern const struct output_backend output_uring;
+#endif
+extern const struct output_backend output_ring;
+extern const struct output_backend output_file;
+// Copies the oldest events kept by the ring backend and removes them
+size_t output_ring_read(struct server *server, struct output_event *events,
+			size_t max_events);
+
+// Allocates the key action queue for the current config. The queue must
+// be empty.
+void action_init(struct server *server);
+void action_finish(struct server *server);
+void action_run(struct server *server, const struct action *action);
+// Sends all the remaining signals of running key actions immediately
+void action_flush(struct server *server);
+pid_t spawn_command(const char *cmd, char *const *argv);
+
+void latency_init(struct server *server);
+// Dumps the histograms and frees them
+void latency_finish(struct server *server);
+void latency_dump(struct server *server);
+// Sets the kernel timestamp of the event being handled
+void latency_begin_event(struct server *server, uint64_t time_usec,
+			 bool gesture);
+// Same as latency_begin_event() for a key which was held back
+void latency_begin_deferred_event(struct server *server, uint64_t time_usec);
+void latency_end_event(struct server *server);
+// Notes that the event being handled produced output through path
+void latency_mark(struct server *server, enum latency_path path);
+// Records the latency of the marked events when their output is written
+void latency_record_output(struct server *server);
+
+bool record_init(struct server *server, const char *path);
+void record_event(struct server *server, const struct ryd_event *event);
+void record_finish(struct server *server);
+// Feeds the events in the recorded file to handle_input_event() at full
+// speed or at the recorded pace, and reports the throughput
+bool replay_run(struct server *server, const char *path, bool realtime);
 
-void action_run(struct server *server, struct action *action);
+// Runs the benchmarks whose names begin with prefix, or all of them if
+// it's NULL, and prints the results to stdout
+bool bench_run(const char *prefix);
 
+// Starts the thread running the actions given to action_run(). It has
+// its own server sharing the config and the output with this one.
+void action_thread_init(struct server *server);
+void action_thread_finish(struct server *server);
+void action_thread_run(struct server *server, const struct action *action);
+// Waits until the actions queued so far are done and switches the thread
+// to config, so that the current config can be freed
+void action_thread_sync(struct server *server, const struct config *config);
+
+// Applies the scheduling, memory locking and CPU affinity in the config
+// to the calling thread, reporting what could not be applied
+void realtime_init(struct server *server);
+// Touches the pages of the config so they are not faulted while handling
+// events
+void realtime_prefault_config(const struct config *config);
+
+void spawn_helper_init(struct server *server);
+void spawn_helper_finish(struct server *server);
+bool spawn_helper_run(struct server *server, const struct action *action);
+
+// Returns the path of the config file, or NULL if it's not present
+const char *config_find_path(void);
+// Loads the config file into config, which must be zeroed. Returns false
+// and leaves config zeroed if it could not be loaded.
+bool config_load(struct config *config, bool use_cache);
+// Same as config_load() but parses yaml without the cache
+bool config_parse(struct config *config, const char *yaml, size_t yaml_len);
+void config_free(struct config *config);
+// Groups the keybinds for device, or for any device if device is NULL, by
+// keycode like keybind_index of the config
+void config_build_keybind_index(const struct config *config,
+				const struct input_device *device,
+				struct keybind **index, uint32_t *offsets);
+// Returns the next state of the sequence matcher, or 0 if keycode doesn't
+// continue any sequence
+uint32_t config_sequence_next(const struct config *config, uint32_t state,
+			      uint32_t keycode);
+// Compiles the keymap of the default RMLVO alone, for the benchmarks of
+// keyname_to_keycode(). Returns NULL if it can't be compiled.
+struct parser_context *config_keymap_new(void);
+void config_keymap_free(struct parser_context *ctx);
+// Returns the keycode of a keysym name, or 0 if it's not in the keymap
+uint32_t keyname_to_keycode(struct parser_context *ctx, const char *keyname);
+// Returns the releases of the keys left pressed by signals, which are
+// appended to key actions
+key_signals_t get_undo_key_signals(key_signals_t *signals);
+// Allocates the arena of config, where the arrays of config point to
+struct config_arena config_alloc(struct config *config,
+				 const struct config_size *size);
 void config_init(struct server *server);
+// Parses the config file ignoring the cache, and saves the cache
+bool config_compile(struct server *server);
 void config_finish(struct server *server);
+
+#define RYDEEN_CACHE_DIR "/var/cache/rydeen"
+#define RYDEEN_CACHE_PATH RYDEEN_CACHE_DIR "/config.cache"
+
+bool config_cache_load(struct config *config, uint64_t hash);
+bool config_cache_save(const struct config *config, uint64_t hash);
@@ -0,0 +1,138 @@
+#include "rydeen.h"
+#include <ev.h>
+#include <string.h>
+
+// Keys continuing a sequence are held back until the sequence is
+// completed, broken by another key or timed out. Releases are held back
+// with them to keep their order. Keys which can't begin a sequence are
+// never held, so ordinary typing isn't delayed.
+
+static void
+handle_sequence_timeout(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct server *server = w->data;
+	sequence_flush(server);
+	latency_end_event(server);
+	uinput_flush(server);
+}
+
+static void
+reset(struct server *server)
+{
+	struct sequence_matcher *matcher = &server->sequence_matcher;
+	matcher->state = 0;
+	matcher->nr_keys = 0;
+	matcher->deferred_pressed = (struct ryd_keyset){0};
+	ev_timer_stop(server->loop, &matcher->timer);
+}
+
+static void
+complete(struct server *server, const struct sequence *sequence)
+{
+	struct sequence_matcher *matcher = &server->sequence_matcher;
+
+	// The keys are consumed, including the releases to come. Releases of
+	// keys pressed before the sequence are still sent.
+	struct deferred_key released[ARRAY_SIZE(matcher->keys)];
+	uint32_t nr_released = 0;
+	for (uint32_t i = 0; i < matcher->nr_keys; i++) {
+		const struct deferred_key *key = &matcher->keys[i];
+		if (key->pressed)
+			ryd_keyset_add(&matcher->swallowed, key->keycode);
+		else if (!ryd_keyset_remove(&matcher->swallowed, key->keycode))
+			released[nr_released++] = *key;
+	}
+	// The latency of the action is the one of the last key
+	uint64_t time_usec = matcher->keys[matcher->nr_keys - 1].time_usec;
+	reset(server);
+	for (uint32_t i = 0; i < nr_released; i++) {
+		latency_begin_event(server, released[i].time_usec, false);
+		process_key_event(server, released[i].device,
+				  released[i].keycode, false);
+	}
+	if (nr_released)
+		latency_begin_event(server, time_usec, false);
+	action_run(server, &sequence->on_match);
+}
+
+bool
+sequence_handle_key(struct server *server, struct input_device *device,
+		    uint64_t time_usec, uint32_t keycode, bool pressed)
+{
+	struct sequence_matcher *matcher = &server->sequence_matcher;
+	struct config *config = &server->config;
+
+	if (!pressed && ryd_keyset_remove(&matcher->swallowed, keycode))
+		return true;
+	if (!config->nr_sequences || keycode >= MAX_KEYCODE)
+		return false;
+
+	uint32_t next = 0;
+	if (pressed) {
+		next = config_sequence_next(config, matcher->state, keycode);
+		if (!next && matcher->state) {
+			// Not a sequence. The keys are sent as typed, and this
+			// one may begin another sequence.
+			sequence_flush(server);
+			latency_begin_event(server, time_usec, false);
+			next = config_sequence_next(config, 0, keycode);
+		}
+		if (!next)
+			return false;
+	} else if (!matcher->nr_keys) {
+		return false;
+	} else {
+		// Even a key pressed before the sequence, which may be a
+		// modifier of the keys held back
+		ryd_keyset_remove(&matcher->deferred_pressed, keycode);
+	}
+
+	if (matcher->nr_keys == ARRAY_SIZE(matcher->keys)) {
+		sequence_flush(server);
+		latency_begin_event(server, time_usec, false);
+		return false;
+	}
+	matcher->keys[matcher->nr_keys++] = (struct deferred_key){
+		.device = device,
+		.time_usec = time_usec,
+		.keycode = keycode,
+		.pressed = pressed,
+	};
+	if (!pressed)
+		return true;
+
+	ryd_keyset_add(&matcher->deferred_pressed, keycode);
+	matcher->state = next;
+	const struct sequence_state *state = &config->sequence_states[next];
+	if (state->match) {
+		complete(server, state->match);
+		return true;
+	}
+
+	ev_timer_stop(server->loop, &matcher->timer);
+	ev_timer_init(&matcher->timer, handle_sequence_timeout, state->timeout,
+		      0.);
+	matcher->timer.data = server;
+	ev_timer_start(server->loop, &matcher->timer);
+	return true;
+}
+
+void
+sequence_flush(struct server *server)
+{
+	struct sequence_matcher *matcher = &server->sequence_matcher;
+	if (!matcher->nr_keys)
+		return;
+
+	struct deferred_key keys[ARRAY_SIZE(matcher->keys)];
+	uint32_t nr_keys = matcher->nr_keys;
+	memcpy(keys, matcher->keys, nr_keys * sizeof(*keys));
+	reset(server);
+
+	// Latencies include the time the keys were held back
+	for (uint32_t i = 0; i < nr_keys; i++) {
+		latency_begin_event(server, keys[i].time_usec, false);
+		process_key_event(server, keys[i].device, keys[i].keycode,
+				  keys[i].pressed);
+	}
+}
@@ -0,0 +1,237 @@
+#include "rydeen.h"
+#include <ev.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Requests from the input thread waiting for the action thread. The input
+// thread only waits when it's full, so that releases are never lost.
+#define ACTION_RING_SIZE 256
+#define CACHE_LINE_SIZE 64
+
+enum action_request_type {
+	ACTION_REQUEST_RUN,
+	ACTION_REQUEST_SYNC,
+	ACTION_REQUEST_STOP,
+};
+
+struct action_request {
+	enum action_request_type type;
+	union {
+		const struct action *action;
+		const struct config *config;
+	};
+};
+
+// Single-producer single-consumer ring. head is only written by the
+// action thread and tail by the input thread, on their own cache lines.
+struct action_ring {
+	alignas(CACHE_LINE_SIZE) atomic_uint head;
+	alignas(CACHE_LINE_SIZE) atomic_uint tail;
+	struct action_request items[ACTION_RING_SIZE];
+};
+
+struct action_thread {
+	struct action_ring ring;
+	pthread_t thread;
+	// Server of the action thread, which has its own loop, key action
+	// queue and output buffer
+	struct server *server;
+	ev_async async;
+	sem_t synced;
+	// Set by the input thread while it waits for room in the ring
+	atomic_bool waiting;
+	sem_t space;
+};
+
+static bool
+ring_push(struct action_ring *ring, const struct action_request *request)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == ACTION_RING_SIZE)
+		return false;
+	ring->items[tail % ACTION_RING_SIZE] = *request;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static bool
+ring_pop(struct action_ring *ring, struct action_request *request)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+	*request = ring->items[head % ACTION_RING_SIZE];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+// Sleeps rather than spinning when the ring is full, as a real-time input
+// thread spinning could keep the action thread from running at all
+static void
+send_request(struct action_thread *thread,
+	     const struct action_request *request)
+{
+	while (!ring_push(&thread->ring, request)) {
+		atomic_store(&thread->waiting, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		// The action thread may have made room before seeing the flag
+		if (ring_push(&thread->ring, request))
+			break;
+		while (sem_wait(&thread->space) < 0)
+			;
+	}
+	ev_async_send(thread->server->loop, &thread->async);
+}
+
+static bool
+pop_request(struct action_thread *thread, struct action_request *request)
+{
+	if (!ring_pop(&thread->ring, request))
+		return false;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&thread->waiting, false))
+		sem_post(&thread->space);
+	return true;
+}
+
+static void
+handle_requests(struct ev_loop *loop, ev_async *w, int revents)
+{
+	struct action_thread *thread = w->data;
+	struct server *server = thread->server;
+
+	struct action_request request;
+	while (pop_request(thread, &request)) {
+		switch (request.type) {
+		case ACTION_REQUEST_RUN:
+			action_run(server, request.action);
+			break;
+		case ACTION_REQUEST_SYNC:
+			action_flush(server);
+			uinput_flush(server);
+			server->config = *request.config;
+			action_init(server);
+			sem_post(&thread->synced);
+			break;
+		case ACTION_REQUEST_STOP:
+			action_finish(server);
+			uinput_finish_shared(server);
+			ev_async_stop(loop, w);
+			ev_break(loop, EVBREAK_ALL);
+			return;
+		}
+	}
+	uinput_flush(server);
+}
+
+static void *
+action_thread_main(void *data)
+{
+	struct action_thread *thread = data;
+	ev_run(thread->server->loop, 0);
+	return NULL;
+}
+
+void
+action_thread_init(struct server *server)
+{
+	struct action_thread *thread = znew(*thread);
+	struct server *action_server = znew(*action_server);
+	action_server->loop = ev_loop_new(EVFLAG_AUTO);
+	// The config is owned by the input thread
+	action_server->config = server->config;
+	action_server->dry_run = server->dry_run;
+	action_server->spawn_helper.fd = -1;
+	action_init(action_server);
+	uinput_init_shared(action_server, server);
+
+	thread->server = action_server;
+	sem_init(&thread->synced, 0, 0);
+	sem_init(&thread->space, 0, 0);
+	thread->async.data = thread;
+	ev_async_init(&thread->async, handle_requests);
+	ev_async_start(action_server->loop, &thread->async);
+
+	// The action thread doesn't take the real-time priority of the
+	// input thread
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	struct sched_param param = {.sched_priority = 0};
+	pthread_attr_setschedparam(&attr, &param);
+	int err = pthread_create(&thread->thread, &attr, action_thread_main,
+				 thread);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		fprintf(stderr, "Could not create action thread, running "
+				"actions on the input thread\n");
+		action_finish(action_server);
+		uinput_finish_shared(action_server);
+		ev_loop_destroy(action_server->loop);
+		free(action_server);
+		sem_destroy(&thread->synced);
+		sem_destroy(&thread->space);
+		free(thread);
+		return;
+	}
+	server->action_thread = thread;
+}
+
+void
+action_thread_finish(struct server *server)
+{
+	struct action_thread *thread = server->action_thread;
+	if (!thread)
+		return;
+
+	struct action_request request = {.type = ACTION_REQUEST_STOP};
+	send_request(thread, &request);
+	pthread_join(thread->thread, NULL);
+
+	ev_loop_destroy(thread->server->loop);
+	free(thread->server);
+	sem_destroy(&thread->synced);
+	sem_destroy(&thread->space);
+	free(thread);
+	server->action_thread = NULL;
+}
+
+void
+action_thread_run(struct server *server, const struct action *action)
+{
+	struct action_thread *thread = server->action_thread;
+	struct action_request request = {
+		.type = ACTION_REQUEST_RUN,
+		.action = action,
+	};
+	send_request(thread, &request);
+
+	// Keys are repeated by this thread like passthrough keys. The repeat
+	// is started when the action is queued, before its signals are sent.
+	if (action->type == ACTION_KEY)
+		uinput_repeat_action(server, action);
+}
+
+void
+action_thread_sync(struct server *server, const struct config *config)
+{
+	struct action_thread *thread = server->action_thread;
+	if (!thread)
+		return;
+
+	struct action_request request = {
+		.type = ACTION_REQUEST_SYNC,
+		.config = config,
+	};
+	send_request(thread, &request);
+	while (sem_wait(&thread->synced) < 0)
+		;
+}
@@ -5,32 +5,118 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define RYDEEN_VENDOR_ID 0xcafe
 #define RYDEEN_KEYBOARD_PRODUCT_ID 0x1234
 #define RYDEEN_MOUSE_PRODUCT_ID 0x1235
 
+static void
+write_events(struct server *server, enum output_device device,
+	     const struct input_event *events, int nr_events)
+{
+	struct uinput *uinput = &server->uinput;
+
+	// Backends take at most UINPUT_BUFFER_SIZE events at once. Runs
+	// of key actions are split between reports as they are pairs of a
+	// key event and a SYN_REPORT.
+	for (int i = 0; i < nr_events; i += UINPUT_BUFFER_SIZE) {
+		int nr = nr_events - i;
+		if (nr > UINPUT_BUFFER_SIZE)
+			nr = UINPUT_BUFFER_SIZE;
+		uinput->backend->write(server, device, &events[i], nr);
+	}
+	if (uinput->backend->flush)
+		uinput->backend->flush(server);
+	uinput->nr_written += nr_events;
+	latency_record_output(server);
+}
+
+void
+uinput_flush(struct server *server)
+{
+	struct uinput *uinput = &server->uinput;
+
+	if (!uinput->buffer_len)
+		return;
+
+	write_events(server, uinput->buffer_device, uinput->buffer,
+		     uinput->buffer_len);
+	uinput->buffer_len = 0;
+}
+
+static void
+queue_event(struct server *server, enum output_device device, uint16_t type,
+	    uint16_t code, int32_t value)
+{
+	struct uinput *uinput = &server->uinput;
+
+	if (uinput->buffer_device != device
+	    || uinput->buffer_len == UINPUT_BUFFER_SIZE)
+		uinput_flush(server);
+	uinput->buffer_device = device;
+
+	// The timestamp is filled by the kernel
+	uinput->buffer[uinput->buffer_len++] = (struct input_event){
+		.type = type,
+		.code = code,
+		.value = value,
+	};
+}
+
+static void
+queue_events(struct server *server, enum output_device device,
+	     const struct input_event *events, uint32_t nr_events)
+{
+	struct uinput *uinput = &server->uinput;
+
+	if (uinput->buffer_device != device
+	    || uinput->buffer_len + nr_events > UINPUT_BUFFER_SIZE)
+		uinput_flush(server);
+	if (nr_events > UINPUT_BUFFER_SIZE) {
+		write_events(server, device, events, nr_events);
+		return;
+	}
+	uinput->buffer_device = device;
+	memcpy(&uinput->buffer[uinput->buffer_len], events,
+	       nr_events * sizeof(*events));
+	uinput->buffer_len += nr_events;
+}
+
+static inline void
+queue_key_event(struct server *server, enum output_device device,
+		uint32_t keycode, int32_t value)
+{
+	queue_event(server, device, EV_KEY, keycode, value);
+	queue_event(server, device, EV_SYN, SYN_REPORT, 0);
+}
+
 static void
 handle_key_repeat(struct ev_loop *loop, struct ev_timer *timer, int revents)
 {
 	struct server *server = timer->data;
 	struct uinput *uinput = &server->uinput;
-	libevdev_uinput_write_event(uinput->keyboard, EV_KEY,
-				    uinput->last_keycode, 2);
-	libevdev_uinput_write_event(uinput->keyboard, EV_SYN, SYN_REPORT, 0);
+	queue_key_event(server, OUTPUT_KEYBOARD, uinput->last_keycode, 2);
+	uinput_flush(server);
 	ev_timer_again(loop, timer);
 }
 
 bool
-is_rydeen_device(struct libevdev *evdev)
+is_rydeen_id(int vendor_id, int product_id)
 {
-	int vendor_id = libevdev_get_id_vendor(evdev);
-	int product_id = libevdev_get_id_product(evdev);
 	return vendor_id == RYDEEN_VENDOR_ID
 	       && (product_id == RYDEEN_KEYBOARD_PRODUCT_ID
 		   || product_id == RYDEEN_MOUSE_PRODUCT_ID);
 }
 
+bool
+is_rydeen_device(struct libevdev *evdev)
+{
+	return is_rydeen_id(libevdev_get_id_vendor(evdev),
+			    libevdev_get_id_product(evdev));
+}
+
 static struct libevdev_uinput *
 create_virtual_keyboard(void)
 {
@@ -85,23 +171,132 @@ create_virtual_mouse(void)
 }
 
 void
-uinput_init(struct server *server)
+uinput_create_devices(struct libevdev_uinput **devices)
+{
+	devices[OUTPUT_KEYBOARD] = create_virtual_keyboard();
+	devices[OUTPUT_MOUSE] = create_virtual_mouse();
+}
+
+void
+uinput_destroy_devices(struct libevdev_uinput **devices)
+{
+	libevdev_uinput_destroy(devices[OUTPUT_KEYBOARD]);
+	libevdev_uinput_destroy(devices[OUTPUT_MOUSE]);
+}
+
+static bool
+uinput_backend_init(struct server *server, const char *arg)
+{
+	struct libevdev_uinput **devices =
+		calloc(OUTPUT_NR_DEVICES, sizeof(*devices));
+	uinput_create_devices(devices);
+	server->uinput.backend_data = devices;
+	return true;
+}
+
+static void
+uinput_backend_write(struct server *server, enum output_device device,
+		     const struct input_event *events, int nr_events)
+{
+	struct libevdev_uinput **devices = server->uinput.backend_data;
+	int fd = libevdev_uinput_get_fd(devices[device]);
+	size_t size = nr_events * sizeof(*events);
+	if (write(fd, events, size) != (ssize_t)size)
+		perror("Could not write to uinput device");
+}
+
+static void
+uinput_backend_finish(struct server *server)
+{
+	struct libevdev_uinput **devices = server->uinput.backend_data;
+	uinput_destroy_devices(devices);
+	free(devices);
+}
+
+const struct output_backend output_uinput = {
+	.name = "uinput",
+	.init = uinput_backend_init,
+	.write = uinput_backend_write,
+	.finish = uinput_backend_finish,
+};
+
+static const struct output_backend *output_backends[] = {
+	&output_uinput,
+#if HAVE_IO_URING
+	&output_uring,
+#endif
+	&output_ring,
+	&output_file,
+};
+
+bool
+uinput_init(struct server *server, const char *output)
+{
+	struct uinput *uinput = &server->uinput;
+
+	if (!output)
+		output = "uinput";
+	const char *arg = strchr(output, ':');
+	size_t name_len = arg ? (size_t)(arg - output) : strlen(output);
+	if (arg)
+		arg++;
+
+	for (int i = 0; i < ARRAY_SIZE(output_backends); i++) {
+		const char *name = output_backends[i]->name;
+		if (strlen(name) == name_len
+		    && !strncmp(name, output, name_len)) {
+			uinput->backend = output_backends[i];
+			break;
+		}
+	}
+	if (!uinput->backend) {
+		fprintf(stderr, "Unknown output: %s\n", output);
+		return false;
+	}
+	if (!uinput->backend->init(server, arg)) {
+		uinput->backend = NULL;
+		return false;
+	}
+	uinput->server = server;
+
+	ev_init(&uinput->repeat_timer, handle_key_repeat);
+	uinput->repeat_timer.data = server;
+	return true;
+}
+
+void
+uinput_init_shared(struct server *server, const struct server *owner)
 {
-	server->uinput.keyboard = create_virtual_keyboard();
-	server->uinput.mouse = create_virtual_mouse();
-	server->uinput.server = server;
+	struct uinput *uinput = &server->uinput;
 
-	ev_init(&server->uinput.repeat_timer, handle_key_repeat);
-	server->uinput.repeat_timer.data = server;
+	uinput->backend = owner->uinput.backend;
+	uinput->backend_data = owner->uinput.backend_data;
+	uinput->server = server;
+	uinput->shared = true;
+}
+
+void
+uinput_finish_shared(struct server *server)
+{
+	struct uinput *uinput = &server->uinput;
+
+	uinput_flush(server);
+	uinput->backend = NULL;
+	uinput->backend_data = NULL;
 }
 
 void
 uinput_finish(struct server *server)
 {
-	libevdev_uinput_destroy(server->uinput.keyboard);
-	server->uinput.keyboard = NULL;
-	libevdev_uinput_destroy(server->uinput.mouse);
-	server->uinput.mouse = NULL;
+	struct uinput *uinput = &server->uinput;
+
+	if (!uinput->backend)
+		return;
+	uinput_flush(server);
+	ev_timer_stop(server->loop, &uinput->repeat_timer);
+	uinput->backend->finish(server);
+	uinput->backend = NULL;
+	uinput->backend_data = NULL;
 }
 
 void
@@ -111,12 +306,9 @@ uinput_send(struct server *server, uint32_t keycode, bool press, bool repeat)
 	struct config *config = &server->config;
 	struct uinput *uinput = &server->uinput;
 
-	if (keycode < 256) {
-		libevdev_uinput_write_event(uinput->keyboard, EV_KEY, keycode,
-					    press);
-		libevdev_uinput_write_event(uinput->keyboard, EV_SYN,
-					    SYN_REPORT, 0);
-		if (repeat) {
+	if (get_output_device(keycode) == OUTPUT_KEYBOARD) {
+		queue_key_event(server, OUTPUT_KEYBOARD, keycode, press);
+		if (repeat && !uinput->shared) {
 			if (press) {
 				if (uinput->last_keycode)
 					ev_timer_stop(loop,
@@ -135,9 +327,49 @@ uinput_send(struct server *server, uint32_t keycode, bool press, bool repeat)
 			}
 		}
 	} else {
-		libevdev_uinput_write_event(uinput->mouse, EV_KEY, keycode,
-					    press);
-		libevdev_uinput_write_event(uinput->mouse, EV_SYN, SYN_REPORT,
-					    0);
+		queue_key_event(server, OUTPUT_MOUSE, keycode, press);
+	}
+}
+
+void
+uinput_repeat_action(struct server *server, const struct action *action)
+{
+	struct ev_loop *loop = server->loop;
+	struct config *config = &server->config;
+	struct uinput *uinput = &server->uinput;
+
+	if (action->presses_key) {
+		if (uinput->last_keycode)
+			ev_timer_stop(loop, &uinput->repeat_timer);
+		uinput->last_keycode = action->repeat_keycode;
+		if (action->repeat_keycode) {
+			ev_timer_set(&uinput->repeat_timer,
+				     config->key_repeat_delay,
+				     config->key_repeat_interval);
+			ev_timer_start(loop, &uinput->repeat_timer);
+		}
+		return;
+	}
+	// Only keys are released, which may include the repeated one
+	for (uint32_t i = 0; i < action->nr_signals && uinput->last_keycode;
+	     i++) {
+		if (action->signals[i].keycode == uinput->last_keycode) {
+			uinput->last_keycode = 0;
+			ev_timer_stop(loop, &uinput->repeat_timer);
+		}
+	}
+}
+
+void
+uinput_send_action(struct server *server, const struct action *action)
+{
+	struct uinput *uinput = &server->uinput;
+
+	for (uint32_t i = 0; i < action->nr_writes; i++) {
+		const struct action_write *write = &action->writes[i];
+		queue_events(server, write->device, write->events,
+			     write->nr_events);
 	}
+	if (!uinput->shared)
+		uinput_repeat_action(server, action);
 }
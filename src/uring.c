@@ -0,0 +1,189 @@
+#include "rydeen.h"
+#include <libevdev/libevdev-uinput.h>
+#include <liburing.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Output backend writing to the uinput devices through io_uring. The writes
+// of a flush are linked to keep their order and submitted with a single
+// syscall.
+#define URING_NR_SLOTS 64
+// Bounds the wait for a free slot in case another thread took the
+// completion which woke up this one
+#define URING_WAIT_TIMEOUT_MS 10
+
+struct uring_slot {
+	struct input_event events[UINPUT_BUFFER_SIZE];
+};
+
+struct uring {
+	pthread_mutex_t lock;
+	struct io_uring ring;
+	struct libevdev_uinput *devices[OUTPUT_NR_DEVICES];
+	// Signaled on completions, so that a thread can wait for a free slot
+	// without holding the lock
+	int event_fd;
+
+	// Events are copied here as the buffer of uinput is reused
+	struct uring_slot slots[URING_NR_SLOTS];
+	int free_slots[URING_NR_SLOTS];
+	int nr_free_slots;
+	// Queued but not submitted
+	struct io_uring_sqe *last_sqe;
+	int nr_queued;
+};
+
+static void
+reap_completions(struct uring *uring)
+{
+	struct io_uring_cqe *cqe;
+	while (!io_uring_peek_cqe(&uring->ring, &cqe)) {
+		if (cqe->res < 0) {
+			fprintf(stderr,
+				"Could not write to uinput device: %s\n",
+				strerror(-cqe->res));
+		}
+		uring->free_slots[uring->nr_free_slots++] =
+			(int)io_uring_cqe_get_data64(cqe);
+		io_uring_cqe_seen(&uring->ring, cqe);
+	}
+}
+
+static void
+submit(struct uring *uring)
+{
+	if (!uring->nr_queued)
+		return;
+	int ret = io_uring_submit(&uring->ring);
+	if (ret < 0) {
+		fprintf(stderr, "Could not submit writes: %s\n",
+			strerror(-ret));
+	}
+	uring->last_sqe = NULL;
+	uring->nr_queued = 0;
+}
+
+static void
+wait_completion(struct uring *uring)
+{
+	struct pollfd pfd = {.fd = uring->event_fd, .events = POLLIN};
+	if (poll(&pfd, 1, URING_WAIT_TIMEOUT_MS) <= 0)
+		return;
+	// Resets the counter, the completions themselves are reaped later
+	uint64_t count;
+	if (read(uring->event_fd, &count, sizeof(count)) < 0)
+		debug("Could not read io_uring eventfd\n");
+}
+
+static bool
+uring_init(struct server *server, const char *arg)
+{
+	struct uring *uring = znew(*uring);
+	int ret = io_uring_queue_init(URING_NR_SLOTS, &uring->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Could not set up io_uring: %s\n",
+			strerror(-ret));
+		free(uring);
+		return false;
+	}
+	uring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (uring->event_fd < 0
+	    || io_uring_register_eventfd(&uring->ring, uring->event_fd) < 0) {
+		perror("Could not set up io_uring");
+		if (uring->event_fd >= 0)
+			close(uring->event_fd);
+		io_uring_queue_exit(&uring->ring);
+		free(uring);
+		return false;
+	}
+	pthread_mutex_init(&uring->lock, NULL);
+	uinput_create_devices(uring->devices);
+	for (int i = 0; i < URING_NR_SLOTS; i++)
+		uring->free_slots[i] = i;
+	uring->nr_free_slots = URING_NR_SLOTS;
+
+	server->uinput.backend_data = uring;
+	return true;
+}
+
+static void
+uring_write(struct server *server, enum output_device device,
+	    const struct input_event *events, int nr_events)
+{
+	struct uring *uring = server->uinput.backend_data;
+
+	pthread_mutex_lock(&uring->lock);
+	reap_completions(uring);
+	while (!uring->nr_free_slots) {
+		// All the slots are in flight. The other thread may write
+		// meanwhile.
+		submit(uring);
+		pthread_mutex_unlock(&uring->lock);
+		wait_completion(uring);
+		pthread_mutex_lock(&uring->lock);
+		reap_completions(uring);
+	}
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+	if (!sqe) {
+		fprintf(stderr, "Could not queue write to uinput device\n");
+		pthread_mutex_unlock(&uring->lock);
+		return;
+	}
+
+	int slot = uring->free_slots[--uring->nr_free_slots];
+	memcpy(uring->slots[slot].events, events,
+	       nr_events * sizeof(*events));
+	int fd = libevdev_uinput_get_fd(uring->devices[device]);
+	io_uring_prep_write(sqe, fd, uring->slots[slot].events,
+			    nr_events * sizeof(*events), 0);
+	io_uring_sqe_set_data64(sqe, slot);
+	// Keep the order of the events across writes
+	if (uring->last_sqe)
+		uring->last_sqe->flags |= IOSQE_IO_LINK;
+	uring->last_sqe = sqe;
+	uring->nr_queued++;
+	pthread_mutex_unlock(&uring->lock);
+}
+
+static void
+uring_flush(struct server *server)
+{
+	struct uring *uring = server->uinput.backend_data;
+
+	pthread_mutex_lock(&uring->lock);
+	submit(uring);
+	pthread_mutex_unlock(&uring->lock);
+}
+
+static void
+uring_finish(struct server *server)
+{
+	struct uring *uring = server->uinput.backend_data;
+
+	submit(uring);
+	// Wait for the writes before the devices are destroyed
+	while (uring->nr_free_slots < URING_NR_SLOTS) {
+		struct io_uring_cqe *cqe;
+		if (io_uring_wait_cqe(&uring->ring, &cqe))
+			break;
+		reap_completions(uring);
+	}
+	io_uring_queue_exit(&uring->ring);
+	close(uring->event_fd);
+	uinput_destroy_devices(uring->devices);
+	pthread_mutex_destroy(&uring->lock);
+	free(uring);
+}
+
+const struct output_backend output_uring = {
+	.name = "uring",
+	.init = uring_init,
+	.write = uring_write,
+	.flush = uring_flush,
+	.finish = uring_finish,
+};
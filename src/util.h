@@ -13,16 +13,44 @@
 #define ARRAY_SIZE(arr) (int)(sizeof(arr) / sizeof((arr)[0]))
 #define znew(sample) calloc(1, sizeof(sample))
 
-#define RYD_SET_MAX_SIZE 16
+#define MAX_KEYCODE 512
 
-struct ryd_set {
-	uint32_t values[RYD_SET_MAX_SIZE];
-	int size;
+// Set of keycodes below MAX_KEYCODE
+struct ryd_keyset {
+	uint64_t words[MAX_KEYCODE / 64];
 };
 
-bool ryd_set_contains(struct ryd_set *set, uint32_t value);
-void ryd_set_add(struct ryd_set *set, uint32_t value);
-void ryd_set_remove(struct ryd_set *set, uint32_t value);
+static inline bool
+ryd_keyset_contains(const struct ryd_keyset *set, uint32_t keycode)
+{
+	if (keycode >= MAX_KEYCODE)
+		return false;
+	return (set->words[keycode / 64] >> (keycode % 64)) & 1;
+}
+
+// Returns true if the keycode was not in the set
+static inline bool
+ryd_keyset_add(struct ryd_keyset *set, uint32_t keycode)
+{
+	if (keycode >= MAX_KEYCODE)
+		return false;
+	uint64_t bit = (uint64_t)1 << (keycode % 64);
+	bool added = !(set->words[keycode / 64] & bit);
+	set->words[keycode / 64] |= bit;
+	return added;
+}
+
+// Returns true if the keycode was in the set
+static inline bool
+ryd_keyset_remove(struct ryd_keyset *set, uint32_t keycode)
+{
+	if (keycode >= MAX_KEYCODE)
+		return false;
+	uint64_t bit = (uint64_t)1 << (keycode % 64);
+	bool removed = set->words[keycode / 64] & bit;
+	set->words[keycode / 64] &= ~bit;
+	return removed;
+}
 
 enum direction {
 	DIRECTION_NONE,